@@ -0,0 +1,9 @@
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+; print 10^6 lines, redirected to a file or a pipe
+;
+; time ./chrysalisp bench/print.lisp < /dev/null > /tmp/print.txt
+; time ./chrysalisp bench/print.lisp < /dev/null | cat > /dev/null
+; time ./chrysalisp -l 1 bench/print.lisp < /dev/null > /tmp/print.txt
+;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
+
+(times 1000000 (print "The quick brown fox jumps over the lazy dog"))
@@ -0,0 +1,157 @@
+/*
+    ChrysaLisp++
+    Copyright (C) 2018 Chris Hinsley
+	chris (dot) hinsley (at) gmail (dot) com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lisp.h"
+#include <fcntl.h>
+#ifndef _WIN64
+	#include <unistd.h>
+#endif
+
+void build_scan(const std::shared_ptr<Lisp_Obj> &form, std::vector<std::string> &deps);
+
+////////////
+//Lisp_Ahead
+////////////
+
+//parses the top level forms of a stream on a background thread, with its
+//own reader instance, into a bounded queue of (form line) for the repl.
+//Reading never depends on evaluation, and the forms are only touched by
+//the repl thread once they leave the queue
+class Lisp_Ahead
+{
+public:
+	Lisp_Ahead(Lisp &owner, const std::shared_ptr<Lisp_IStream> &in, const std::string &name, size_t capacity);
+	~Lisp_Ahead();
+	std::shared_ptr<Lisp_Obj> pop(long long &line);
+private:
+	void reader(const std::string &name);
+	void prefetch(const std::shared_ptr<Lisp_Obj> &form);
+	Lisp &m_owner;
+	std::shared_ptr<Lisp> m_lisp;
+	std::shared_ptr<Lisp_IStream> m_in;
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+	std::deque<std::pair<std::shared_ptr<Lisp_Obj>, long long>> m_queue;
+	std::set<std::string> m_prefetched;
+	size_t m_capacity;
+	bool m_quit = false;
+	std::thread m_thread;
+};
+
+Lisp_Ahead::Lisp_Ahead(Lisp &owner, const std::shared_ptr<Lisp_IStream> &in, const std::string &name, size_t capacity)
+	: m_owner(owner)
+	, m_in(in)
+	, m_capacity(capacity)
+{
+	//reader instances are reused, nested repls each take their own
+	if (m_owner.m_readers.empty())
+	{
+		m_lisp = std::make_shared<Lisp>();
+		m_lisp->m_pool_size = 0;
+	}
+	else
+	{
+		m_lisp = m_owner.m_readers.back();
+		m_owner.m_readers.pop_back();
+	}
+	m_thread = std::thread(&Lisp_Ahead::reader, this, name);
+}
+
+Lisp_Ahead::~Lisp_Ahead()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_not_full.notify_one();
+	m_thread.join();
+	m_queue.clear();
+	m_owner.m_readers.push_back(m_lisp);
+}
+
+void Lisp_Ahead::prefetch(const std::shared_ptr<Lisp_Obj> &form)
+{
+	//start reading in files this form is going to import
+#ifndef _WIN64
+	std::vector<std::string> deps;
+	build_scan(form, deps);
+	for (auto &&path : deps)
+	{
+		if (!m_prefetched.insert(path).second) continue;
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) continue;
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+		close(fd);
+	}
+#endif
+}
+
+void Lisp_Ahead::reader(const std::string &name)
+{
+	auto &lisp = *m_lisp;
+	lisp.m_env->set(lisp.m_sym_stream_name, std::make_shared<Lisp_String>(name));
+	lisp.m_env->set(lisp.m_sym_stream_line, std::make_shared<Lisp_Integer>(1));
+	lisp.m_read_stream = m_in.get();
+	m_in->m_line = 1;
+	for (;;)
+	{
+		auto obj = lisp.repl_read(*m_in);
+		auto last = obj == lisp.m_sym_nil || obj->type() == lisp_type_error;
+		if (!last) prefetch(obj);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_not_full.wait(lock, [&] { return m_quit || m_queue.size() < m_capacity; });
+		if (m_quit) break;
+		m_queue.emplace_back(std::move(obj), m_in->m_line);
+		lock.unlock();
+		m_not_empty.notify_one();
+		if (last) break;
+	}
+	lisp.m_env->set(lisp.m_sym_stream_line, std::make_shared<Lisp_Integer>(0));
+	lisp.m_read_stream = nullptr;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp_Ahead::pop(long long &line)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_not_empty.wait(lock, [&] { return !m_queue.empty(); });
+	auto obj = std::move(m_queue.front().first);
+	line = m_queue.front().second;
+	m_queue.pop_front();
+	lock.unlock();
+	m_not_full.notify_one();
+	return obj;
+}
+
+std::shared_ptr<Lisp_Ahead> Lisp::ahead_start(const std::shared_ptr<Lisp_IStream> &in, const std::string &name)
+{
+	if (m_parse_ahead <= 0 || in->type() != lisp_type_file_istream) return nullptr;
+	return std::make_shared<Lisp_Ahead>(*this, in, name, m_parse_ahead);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::ahead_read(const std::shared_ptr<Lisp_Ahead> &ahead)
+{
+	long long line;
+	auto obj = ahead->pop(line);
+	m_env->set(m_sym_stream_line, std::make_shared<Lisp_Integer>(line));
+	return obj;
+}
@@ -212,6 +212,49 @@ std::shared_ptr<Lisp_Obj> Lisp::eval(const std::shared_ptr<Lisp_List> &args)
 	return repl_error("(eval form [env])", error_msg_wrong_num_of_args, args);
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::evalbudget(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if (len < 2 || len > 4)
+		return repl_error("(eval-budget form steps [usecs [allocs]])", error_msg_wrong_num_of_args, args);
+	if (!std::all_of(begin(args->m_v) + 1, end(args->m_v), [] (auto &&o) { return o->is_type(lisp_type_integer); }))
+		return repl_error("(eval-budget form steps [usecs [allocs]])", error_msg_not_a_number, args);
+	auto limit = [&] (int i) { return i < len ? std::static_pointer_cast<Lisp_Integer>(args->m_v[i])->m_value : 0; };
+	auto steps = limit(1), usecs = limit(2), allocs = limit(3);
+
+	//limits of zero or less are unlimited, a nested budget never outlasts
+	//the one around it
+	auto outer = m_budget;
+	auto outer_left = outer.m_steps + std::max(m_tick, 0ll);
+	auto &b = m_budget;
+	if (steps > 0)
+	{
+		b.m_steps = outer.m_step_limit ? std::min(steps, outer_left) : steps;
+		b.m_step_limit = true;
+	}
+	else if (outer.m_step_limit) b.m_steps = outer_left;
+	if (usecs > 0)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(usecs);
+		b.m_deadline = outer.m_time_limit ? std::min(deadline, outer.m_deadline) : deadline;
+		b.m_time_limit = true;
+	}
+	if (allocs > 0)
+	{
+		auto max_allocs = lisp_obj_allocs + allocs;
+		b.m_allocs = outer.m_alloc_limit ? std::min(max_allocs, outer.m_allocs) : max_allocs;
+		b.m_alloc_limit = true;
+	}
+	auto total = b.m_steps;
+	m_tick = 0;
+	auto value = repl_eval(args->m_v[0]);
+	auto used = total - (b.m_steps + std::max(m_tick, 0ll));
+	m_budget = outer;
+	if (outer.m_step_limit) m_budget.m_steps = outer_left - used;
+	m_tick = 0;
+	return value;
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::apply(const std::shared_ptr<Lisp_List> &args)
 {
 	if (args->length() == 2
@@ -0,0 +1,357 @@
+/*
+    ChrysaLisp++
+    Copyright (C) 2018 Chris Hinsley
+	chris (dot) hinsley (at) gmail (dot) com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lisp.h"
+#ifndef _WIN64
+	#include <ucontext.h>
+	#include <sys/mman.h>
+#endif
+
+const size_t co_stack_size = 8 * 1024 * 1024;
+const size_t co_guard_size = 4096;
+
+enum
+{
+	co_state_ready,
+	co_state_parked,
+	co_state_done,
+};
+
+////////////////
+//Lisp_Coroutine
+////////////////
+
+//a green thread inside one Lisp instance, it runs on its own pooled stack
+//with its own dynamic env chain, and only switches at co-yield, co-join or
+//a read that would block
+class Lisp_Coroutine : public Lisp_Obj
+{
+public:
+	Lisp_Coroutine(const std::shared_ptr<Lisp_Obj> &func, const std::shared_ptr<Lisp_List> &args,
+		const std::shared_ptr<Lisp_Env> &env)
+		: Lisp_Obj()
+		, m_func(func)
+		, m_args(args)
+		, m_env(env)
+	{}
+	~Lisp_Coroutine();
+	const Lisp_Type type() const override { return lisp_type_coroutine; }
+	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_coroutine); }
+	void print(std::ostream &out) const override { out << "<coroutine>"; }
+	std::shared_ptr<Lisp_Obj> m_func;
+	std::shared_ptr<Lisp_List> m_args;
+	std::shared_ptr<Lisp_Env> m_env;
+	std::shared_ptr<Lisp_Obj> m_value;
+	Lisp_IStream *m_wait = nullptr;
+	Lisp_IStream *m_read_stream = nullptr;
+	int m_state = co_state_ready;
+	bool m_cancel = false;
+	char *m_stack = nullptr;
+#ifndef _WIN64
+	ucontext_t m_ctx;
+#endif
+};
+
+Lisp_Coroutine::~Lisp_Coroutine()
+{
+	//the scheduler unwinds suspended coroutines before dropping them, so
+	//nothing is left on a stack by the time it goes
+#ifndef _WIN64
+	if (m_stack) munmap(m_stack, co_stack_size);
+#endif
+}
+
+////////////
+//Lisp_Sched
+////////////
+
+class Lisp_Sched
+{
+public:
+	~Lisp_Sched();
+	char *alloc_stack();
+	void free_stack(char *stack);
+	void resume(Lisp &lisp, const std::shared_ptr<Lisp_Coroutine> &co);
+	bool suspend();
+	bool step(Lisp &lisp);
+	void cancel(Lisp &lisp);
+	std::deque<std::shared_ptr<Lisp_Coroutine>> m_ready;
+	std::vector<std::shared_ptr<Lisp_Coroutine>> m_parked;
+	std::vector<char*> m_stacks;
+	std::shared_ptr<Lisp_Coroutine> m_current;
+#ifndef _WIN64
+	ucontext_t m_main;
+#endif
+};
+
+#ifdef _WIN64
+Lisp_Sched::~Lisp_Sched()
+{}
+
+bool Lisp_Sched::step(Lisp &lisp)
+{
+	return false;
+}
+
+void Lisp_Sched::cancel(Lisp &lisp)
+{}
+#else
+static thread_local Lisp *co_lisp;
+
+static void co_entry()
+{
+	auto &lisp = *co_lisp;
+	auto co = lisp.m_sched->m_current;
+	co->m_value = lisp.repl_apply(co->m_func, co->m_args);
+	co->m_state = co_state_done;
+	co->m_func.reset();
+	co->m_args.reset();
+	co->m_env.reset();
+	//falls back into the scheduler through uc_link
+}
+
+Lisp_Sched::~Lisp_Sched()
+{
+	for (auto stack : m_stacks) munmap(stack, co_stack_size);
+}
+
+char *Lisp_Sched::alloc_stack()
+{
+	//stacks are reserved, not committed, with a guard page below
+	if (!m_stacks.empty())
+	{
+		auto stack = m_stacks.back();
+		m_stacks.pop_back();
+		return stack;
+	}
+	auto stack = (char*)mmap(nullptr, co_stack_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED) return nullptr;
+	mprotect(stack, co_guard_size, PROT_NONE);
+	return stack;
+}
+
+void Lisp_Sched::free_stack(char *stack)
+{
+	m_stacks.push_back(stack);
+}
+
+void Lisp_Sched::resume(Lisp &lisp, const std::shared_ptr<Lisp_Coroutine> &co)
+{
+	if (!co->m_stack)
+	{
+		co->m_stack = alloc_stack();
+		if (!co->m_stack)
+		{
+			co->m_value = lisp.repl_error("(co-spawn lambda [args])", error_msg_wrong_types, lisp.m_sym_nil);
+			co->m_state = co_state_done;
+			return;
+		}
+		getcontext(&co->m_ctx);
+		co->m_ctx.uc_stack.ss_sp = co->m_stack + co_guard_size;
+		co->m_ctx.uc_stack.ss_size = co_stack_size - co_guard_size;
+		co->m_ctx.uc_link = &m_main;
+		makecontext(&co->m_ctx, co_entry, 0);
+	}
+	auto old_env = lisp.m_env;
+	auto old_read_stream = lisp.m_read_stream;
+	lisp.m_env = co->m_env;
+	lisp.m_read_stream = co->m_read_stream;
+	m_current = co;
+	co_lisp = &lisp;
+	swapcontext(&m_main, &co->m_ctx);
+	m_current.reset();
+	if (co->m_state != co_state_done) co->m_env = lisp.m_env;
+	co->m_read_stream = lisp.m_read_stream;
+	lisp.m_env = old_env;
+	lisp.m_read_stream = old_read_stream;
+	switch (co->m_state)
+	{
+	case co_state_done:
+		free_stack(co->m_stack);
+		co->m_stack = nullptr;
+		break;
+	case co_state_parked:
+		m_parked.push_back(co);
+		break;
+	default:
+		m_ready.push_back(co);
+	}
+}
+
+bool Lisp_Sched::suspend()
+{
+	//false once the coroutine is cancelled and must unwind
+	auto &co = *m_current;
+	if (co.m_cancel) return false;
+	swapcontext(&co.m_ctx, &m_main);
+	return !co.m_cancel;
+}
+
+bool Lisp_Sched::step(Lisp &lisp)
+{
+	//wake parked coroutines whose stream has input, or all of them when
+	//nothing else could run, then give each runnable coroutine one slice
+	for (auto itr = begin(m_parked); itr != end(m_parked);)
+	{
+		auto &co = *itr;
+		if (m_ready.empty() || co->m_wait->ready())
+		{
+			co->m_state = co_state_ready;
+			co->m_wait = nullptr;
+			m_ready.push_back(co);
+			itr = m_parked.erase(itr);
+		}
+		else ++itr;
+	}
+	if (m_ready.empty()) return false;
+	for (auto n = m_ready.size(); n; --n)
+	{
+		auto co = m_ready.front();
+		m_ready.pop_front();
+		resume(lisp, co);
+	}
+	return true;
+}
+
+void Lisp_Sched::cancel(Lisp &lisp)
+{
+	//suspended coroutines are resumed cancelled and under a spent budget, so
+	//every eval fails and they unwind, releasing what their stacks hold
+	auto budget = lisp.m_budget;
+	auto tick = lisp.m_tick;
+	lisp.m_budget = Lisp_Budget();
+	lisp.m_budget.m_step_limit = true;
+	while (!m_ready.empty() || !m_parked.empty())
+	{
+		for (auto &&co : m_parked) m_ready.push_back(co);
+		m_parked.clear();
+		while (!m_ready.empty())
+		{
+			auto co = m_ready.front();
+			m_ready.pop_front();
+			co->m_cancel = true;
+			co->m_state = co_state_ready;
+			co->m_wait = nullptr;
+			if (!co->m_stack)
+			{
+				co->m_state = co_state_done;
+				continue;
+			}
+			lisp.m_tick = 0;
+			resume(lisp, co);
+		}
+	}
+	lisp.m_budget = budget;
+	lisp.m_tick = tick;
+}
+#endif
+
+void Lisp::co_cancel()
+{
+	if (m_sched) m_sched->cancel(*this);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::co_wait(Lisp_IStream &in)
+{
+	//a coroutine about to block on a read parks until the stream has input,
+	//one cancelled while parked gets an error instead of blocking
+	if (!m_sched || !m_sched->m_current) return nullptr;
+#ifndef _WIN64
+	if (!m_sched->m_current->m_cancel)
+	{
+		if (in.ready()) return nullptr;
+		m_sched->m_current->m_wait = &in;
+		m_sched->m_current->m_state = co_state_parked;
+		if (m_sched->suspend()) return nullptr;
+	}
+	return repl_error("(co-spawn lambda [args])", error_msg_cancelled, m_sym_nil);
+#else
+	return nullptr;
+#endif
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::cospawn(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if ((len == 1 || len == 2)
+		&& (len == 1 || args->m_v[1]->is_type(lisp_type_list)))
+	{
+		auto params = len == 2 ? std::static_pointer_cast<Lisp_List>(args->m_v[1]) : std::make_shared<Lisp_List>();
+		auto env = std::make_shared<Lisp_Env>();
+		env->set_parent(m_env);
+		auto co = std::make_shared<Lisp_Coroutine>(args->m_v[0], params, env);
+		if (!m_sched) m_sched = std::make_shared<Lisp_Sched>();
+#ifdef _WIN64
+		//no stack switching here, so a coroutine runs to completion at once
+		auto old_env = m_env;
+		m_env = env;
+		co->m_value = repl_apply(co->m_func, co->m_args);
+		co->m_state = co_state_done;
+		m_env = old_env;
+#else
+		m_sched->m_ready.push_back(co);
+#endif
+		return co;
+	}
+	return repl_error("(co-spawn lambda [args])", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::coyield(const std::shared_ptr<Lisp_List> &args)
+{
+	if (!args->length())
+	{
+		//inside a coroutine go to the back of the queue, outside run one round
+		if (!m_sched) return m_sym_nil;
+#ifndef _WIN64
+		if (m_sched->m_current)
+		{
+			if (!m_sched->suspend()) return repl_error("(co-yield)", error_msg_cancelled, args);
+		}
+		else m_sched->step(*this);
+#endif
+		return m_sym_nil;
+	}
+	return repl_error("(co-yield)", error_msg_wrong_num_of_args, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::cojoin(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_coroutine))
+	{
+		//joining itself, or one nothing can ever finish, would wait forever
+		auto co = std::static_pointer_cast<Lisp_Coroutine>(args->m_v[0]);
+		while (co->m_state != co_state_done)
+		{
+			if (co == m_sched->m_current)
+				return repl_error("(co-join coroutine)", error_msg_deadlock, args);
+#ifndef _WIN64
+			if (m_sched->m_current)
+			{
+				if (!m_sched->suspend()) return repl_error("(co-join coroutine)", error_msg_cancelled, args);
+			}
+			else if (!m_sched->step(*this)) return repl_error("(co-join coroutine)", error_msg_deadlock, args);
+#endif
+		}
+		if (co->m_value) return co->m_value;
+	}
+	return repl_error("(co-join coroutine)", error_msg_wrong_types, args);
+}
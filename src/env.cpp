@@ -19,6 +19,7 @@
 */
 
 #include "lisp.h"
+#include <unordered_set>
 
 std::shared_ptr<Lisp_Symbol> intern(const std::shared_ptr<Lisp_Symbol> &sym);
 
@@ -34,6 +35,85 @@ void Lisp::env_pop()
 	m_env = m_env->get_parent();
 }
 
+std::shared_ptr<Lisp_Env> Lisp::env_root() const
+{
+	auto env = m_env;
+	while (env->m_parent) env = env->m_parent;
+	return env;
+}
+
+std::shared_ptr<Lisp_Env> Lisp::env_fork(const std::shared_ptr<Lisp_Env> &env) const
+{
+	//copy on write child, shares all the parent buckets until a binding is set
+	auto fork = std::make_shared<Lisp_Env>(env->m_buckets.size());
+	fork->set_parent(env);
+	fork->m_fork = true;
+	return fork;
+}
+
+std::shared_ptr<Lisp_Env> Lisp::env_overlay(const std::shared_ptr<Lisp_Env> &env) const
+{
+	//a fork that owns the bindings the reader and import mutate in place, so
+	//nothing evaluated in it writes to the envs below, sealed or shared
+	auto overlay = env_fork(env);
+	overlay->insert(m_sym_stream_name, env->get(m_sym_stream_name));
+	auto line = env->get(m_sym_stream_line);
+	if (line && line->type() == lisp_type_integer)
+		line = std::make_shared<Lisp_Integer>(std::static_pointer_cast<Lisp_Integer>(line)->m_value);
+	overlay->insert(m_sym_stream_line, line);
+	auto includes = env->get(m_sym_file_includes);
+	if (includes && includes->type() == lisp_type_list)
+		includes = std::static_pointer_cast<Lisp_List>(includes)->slice(0, std::static_pointer_cast<Lisp_List>(includes)->length());
+	overlay->insert(m_sym_file_includes, includes);
+	return overlay;
+}
+
+std::shared_ptr<Lisp_Env> Lisp::env_closure(const std::shared_ptr<Lisp_Obj> &obj) const
+{
+	//the bindings obj can reach by name, followed through whatever they are
+	//bound to, plus those env_overlay copies, taken from the envs above the
+	//first sealed one, which becomes the parent and is shared as is
+	auto sealed = m_env;
+	while (sealed && !sealed->m_sealed) sealed = sealed->m_parent;
+	auto closure = std::make_shared<Lisp_Env>(env_root()->m_buckets.size());
+	if (sealed) closure->set_parent(sealed);
+	std::unordered_set<const Lisp_Obj*> seen;
+	std::vector<std::shared_ptr<Lisp_Obj>> todo = {obj, m_sym_stream_name, m_sym_stream_line, m_sym_file_includes};
+	while (!todo.empty())
+	{
+		auto o = std::move(todo.back());
+		todo.pop_back();
+		if (!seen.insert(o.get()).second) continue;
+		if (o->type() == lisp_type_list)
+		{
+			auto &v = std::static_pointer_cast<Lisp_List>(o)->m_v;
+			todo.insert(end(todo), begin(v), end(v));
+		}
+		else if (o->type() == lisp_type_symbol)
+		{
+			auto sym = std::static_pointer_cast<Lisp_Symbol>(o);
+			for (auto env = m_env.get(); env && !env->m_sealed; env = env->m_parent.get())
+			{
+				auto bucket = env->get_bucket(sym);
+				auto itr = std::find_if(begin(*bucket), end(*bucket), [&] (auto &e) { return e.first == sym; });
+				if (itr == end(*bucket)) continue;
+				closure->insert(sym, itr->second);
+				todo.push_back(itr->second);
+				break;
+			}
+		}
+	}
+	return closure;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::env_write_error(const std::string &msg, const std::shared_ptr<Lisp_Env> &env,
+	const std::shared_ptr<Lisp_Symbol> &sym, const std::shared_ptr<Lisp_List> &args)
+{
+	//a failed set is a sealed binding if the symbol is bound at all
+	if (env->find(sym)) return repl_error(msg, error_msg_rebind_constant, args);
+	return repl_error(msg, error_msg_symbol_not_bound, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::env_bind(const std::shared_ptr<Lisp_Obj> &lst, const std::shared_ptr<Lisp_Obj> &seq)
 {
 	if (!lst->is_type(lisp_type_list)) return repl_error("(bind (param ...) seq)", error_msg_not_a_list, lst);
@@ -86,6 +166,7 @@ std::shared_ptr<Lisp_Obj> Lisp::env_bind(const std::shared_ptr<Lisp_Obj> &lst, c
 				value = vals->elem(index_vals++);
 				index_vars++;
 			}
+			if (m_env->m_sealed) return repl_error("(bind (param ...) seq)", error_msg_rebind_constant, lst);
 			m_env->insert(std::static_pointer_cast<Lisp_Symbol>(sym), value);
 		}
 		else if (sym->type() == lisp_type_list
@@ -138,6 +219,37 @@ std::shared_ptr<Lisp_Obj> Lisp::penv(const std::shared_ptr<Lisp_List> &args)
 	return repl_error("(penv [env])", error_msg_wrong_types, args);
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::envfork(const std::shared_ptr<Lisp_List> &args)
+{
+	if (!args->length())
+	{
+		return env_fork(env_root());
+	}
+	else if (args->length() == 1 && args->m_v[0]->is_type(lisp_type_env))
+	{
+		return env_fork(std::static_pointer_cast<Lisp_Env>(args->m_v[0]));
+	}
+	return repl_error("(env-fork [env])", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::envseal(const std::shared_ptr<Lisp_List> &args)
+{
+	//only the bindings become read only, the values bound are still shared
+	//and mutable, so threads must not change them in place
+	if (!args->length())
+	{
+		auto root = env_root();
+		root->m_sealed = true;
+		return root;
+	}
+	else if (args->length() == 1 && args->m_v[0]->is_type(lisp_type_env))
+	{
+		std::static_pointer_cast<Lisp_Env>(args->m_v[0])->m_sealed = true;
+		return args->m_v[0];
+	}
+	return repl_error("(env-seal [env])", error_msg_wrong_types, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::defq(const std::shared_ptr<Lisp_List> &args)
 {
 	auto len = args->length();
@@ -149,6 +261,8 @@ std::shared_ptr<Lisp_Obj> Lisp::defq(const std::shared_ptr<Lisp_List> &args)
 			if (!(*itr)->is_type(lisp_type_symbol))
 				return repl_error("(defq var val [var val] ...)", error_msg_not_a_symbol, args);
 			auto sym = std::static_pointer_cast<Lisp_Symbol>(*itr);
+			if (m_env->m_sealed)
+				return repl_error("(defq var val [var val] ...)", error_msg_rebind_constant, args);
 			value = repl_eval(*(++itr));
 			if (value->type() == lisp_type_error) break;
 			m_env->insert(sym, value);
@@ -174,7 +288,7 @@ std::shared_ptr<Lisp_Obj> Lisp::setq(const std::shared_ptr<Lisp_List> &args)
 			value = repl_eval(*(++itr));
 			if (value->type() == lisp_type_error) break;
 			if (!m_env->set(sym, value))
-				return repl_error("(setq var val [var val] ...)", error_msg_symbol_not_bound, args);
+				return env_write_error("(setq var val [var val] ...)", m_env, sym, args);
 		}
 		return value;
 	}
@@ -190,6 +304,8 @@ std::shared_ptr<Lisp_Obj> Lisp::def(const std::shared_ptr<Lisp_List> &args)
 		{
 			auto env = std::static_pointer_cast<Lisp_Env>(args->m_v[0]);
 			auto value = std::static_pointer_cast<Lisp_Obj>(m_sym_nil);
+			if (env->m_sealed)
+				return repl_error("(def env var val [var val] ...)", error_msg_rebind_constant, args);
 			for (auto itr = begin(args->m_v) + 1; itr != end(args->m_v); ++itr)
 			{
 				if (!(*itr)->is_type(lisp_type_symbol))
@@ -213,6 +329,8 @@ std::shared_ptr<Lisp_Obj> Lisp::undef(const std::shared_ptr<Lisp_List> &args)
 		if (args->m_v[0]->is_type(lisp_type_env))
 		{
 			auto env = std::static_pointer_cast<Lisp_Env>(args->m_v[0]);
+			if (env->m_sealed)
+				return repl_error("(undef env var [var] ...)", error_msg_rebind_constant, args);
 			for (auto itr = begin(args->m_v) + 1; itr != end(args->m_v); ++itr)
 			{
 				if (!(*itr)->is_type(lisp_type_symbol))
@@ -244,7 +362,7 @@ std::shared_ptr<Lisp_Obj> Lisp::set(const std::shared_ptr<Lisp_List> &args)
 					return repl_error("(setq var val [var val] ...)", error_msg_rebind_constant, args);
 				value = (*(++itr));
 				if (!env->set(sym, value))
-					return repl_error("(set env var val [var val] ...)", error_msg_symbol_not_bound, args);
+					return env_write_error("(set env var val [var val] ...)", env, sym, args);
 			}
 			return value;
 		}
@@ -311,6 +429,8 @@ std::shared_ptr<Lisp_Obj> Lisp::defmacro(const std::shared_ptr<Lisp_List> &args)
 				auto body = args->slice(1, args->length());
 				auto sym = std::static_pointer_cast<Lisp_Symbol>(args->m_v[1]);
 				std::static_pointer_cast<Lisp_List>(body)->m_v[0] = m_sym_macro;
+				if (m_env->m_sealed)
+					return repl_error("(defmacro name ([arg ...]) body)", error_msg_rebind_constant, args);
 				m_env->insert(sym, body);
 				return sym;
 			}
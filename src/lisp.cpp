@@ -19,15 +19,47 @@
 */
 
 #include "lisp.h"
+#include <fcntl.h>
+#include <cerrno>
+#include <unordered_set>
+#ifdef _WIN64
+	#include <io.h>
+#else
+	#include <unistd.h>
+	#include <poll.h>
+	#include <sys/ioctl.h>
+	#include <sys/mman.h>
+	#include <sys/uio.h>
+#endif
+#ifndef IOV_MAX
+	#define IOV_MAX 1024
+#endif
+
+const size_t istream_chunk_size = 64 * 1024;
+const size_t ostream_buffer_size = 64 * 1024;
 
 void rmkdir(const char *path);
-std::set<std::shared_ptr<Lisp_Symbol>, Intern_Cmp> intern_sym_set;
+
+thread_local unsigned long long lisp_obj_allocs = 0;
+
+//intern table is shared by all instances, sharded to keep lock contention
+//down between threads
+const int intern_num_shards = 64;
+struct Intern_Shard
+{
+	std::mutex m_mutex;
+	std::set<std::shared_ptr<Lisp_Symbol>, Intern_Cmp> m_set;
+};
+Intern_Shard intern_shards[intern_num_shards];
 
 std::shared_ptr<Lisp_Symbol> intern(const std::shared_ptr<Lisp_Symbol> &sym)
 {
-	auto itr = intern_sym_set.find(sym);
-	if (itr != end(intern_sym_set)) return *itr;
-	intern_sym_set.insert(sym);
+	//hash is cached before the symbol is published, so it's never written again
+	auto &shard = intern_shards[sym->hash() % intern_num_shards];
+	std::lock_guard<std::mutex> lock(shard.m_mutex);
+	auto itr = shard.m_set.find(sym);
+	if (itr != end(shard.m_set)) return *itr;
+	shard.m_set.insert(sym);
 	return sym;
 }
 
@@ -43,6 +75,21 @@ Lisp_Error::Lisp_Error(const std::string &msg, const std::string &file, int line
 	, m_obj(o)
 {}
 
+//////////
+//Lisp_Obj
+//////////
+
+void Lisp_Obj::print_to(std::string &out) const
+{
+	std::ostringstream ss;
+	print(ss);
+	out.append(ss.str());
+}
+
+///////////
+//Lisp_Error
+///////////
+
 void Lisp_Error::print(std::ostream &out) const
 {
 	out << "Error: " << m_msg << " ! < ";
@@ -64,6 +111,33 @@ void Lisp_Integer::print(std::ostream &out) const
 	out << m_value;
 }
 
+void Lisp_Integer::print_to(std::string &out) const
+{
+	//two digits at a time from the table, back to front
+	static const char digits[] =
+		"0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+		"5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+	char buf[24];
+	auto end = buf + sizeof(buf);
+	auto p = end;
+	auto u = m_value < 0 ? 0ull - (unsigned long long)m_value : (unsigned long long)m_value;
+	while (u >= 100)
+	{
+		auto i = (u % 100) * 2;
+		u /= 100;
+		*--p = digits[i + 1];
+		*--p = digits[i];
+	}
+	if (u >= 10)
+	{
+		*--p = digits[u * 2 + 1];
+		*--p = digits[u * 2];
+	}
+	else *--p = (char)('0' + u);
+	if (m_value < 0) *--p = '-';
+	out.append(p, end - p);
+}
+
 std::shared_ptr<Lisp_List> Lisp_Integer::type_of() const
 {
 	auto lst = Lisp_Obj::type_of();
@@ -108,6 +182,33 @@ void Lisp_List::print(std::ostream &out) const
 	out << ')';
 }
 
+void Lisp_List::print_to(std::string &out) const
+{
+	//nested lists are walked with a stack of positions, not recursion
+	std::vector<std::pair<const Lisp_List*, size_t>> stack;
+	out.push_back('(');
+	stack.emplace_back(this, 0);
+	while (!stack.empty())
+	{
+		auto lst = stack.back().first;
+		auto i = stack.back().second++;
+		if (i == lst->m_v.size())
+		{
+			out.push_back(')');
+			stack.pop_back();
+			continue;
+		}
+		if (i) out.push_back(' ');
+		auto &o = lst->m_v[i];
+		if (o->type() == lisp_type_list)
+		{
+			out.push_back('(');
+			stack.emplace_back(static_cast<const Lisp_List*>(o.get()), 0);
+		}
+		else o->print_to(out);
+	}
+}
+
 long long Lisp_List::length() const
 {
 	return m_v.size();
@@ -155,6 +256,11 @@ Lisp_String::Lisp_String(const std::string &s)
 	, m_string(s)
 {}
 
+Lisp_String::Lisp_String(std::string &&s)
+	: Lisp_Seq()
+	, m_string(std::move(s))
+{}
+
 Lisp_String::Lisp_String(char c)
 	: Lisp_Seq()
 	, m_string(std::string{c})
@@ -172,6 +278,13 @@ void Lisp_String::print(std::ostream &out) const
 	out << '"' << m_string << '"';
 }
 
+void Lisp_String::print_to(std::string &out) const
+{
+	out.push_back('"');
+	out.append(m_string);
+	out.push_back('"');
+}
+
 void Lisp_String::print1(std::ostream &out) const
 {
 	out << m_string;
@@ -261,6 +374,11 @@ void Lisp_Symbol::print(std::ostream &out) const
 	out << m_string;
 }
 
+void Lisp_Symbol::print_to(std::string &out) const
+{
+	out.append(m_string);
+}
+
 //////////
 //Lisp_Env
 //////////
@@ -308,6 +426,23 @@ void Lisp_Env::print(std::ostream &out) const
 	out << ')';
 }
 
+void Lisp_Env::print_to(std::string &out) const
+{
+	out.push_back('(');
+	for (auto &&bucket : m_buckets)
+	{
+		for (auto &&pair : bucket)
+		{
+			out.push_back('(');
+			pair.first->print_to(out);
+			out.push_back(' ');
+			pair.second->print_to(out);
+			out.push_back(')');
+		}
+	}
+	out.push_back(')');
+}
+
 void Lisp_Env::set_parent(const std::shared_ptr<Lisp_Env> &env)
 {
 	m_parent = env;
@@ -341,9 +476,31 @@ Lisp_Env_Pair *Lisp_Env::find(const std::shared_ptr<Lisp_Symbol> &sym)
 
 Lisp_Env_Pair *Lisp_Env::set(const std::shared_ptr<Lisp_Symbol> &sym, const std::shared_ptr<Lisp_Obj> &obj)
 {
-	auto itr = find(sym);
-	if (itr != nullptr) itr->second = obj;
-	return itr;
+	//writes through a fork never touch the shared parents, the binding is
+	//copied into the innermost fork on first write
+	auto env = this;
+	Lisp_Env *fork = nullptr;
+	for (;;)
+	{
+		auto bucket = env->get_bucket(sym);
+		auto itr = std::find_if(begin(*bucket), end(*bucket), [&] (auto &e) { return e.first == sym; });
+		if (itr != end(*bucket))
+		{
+			if (fork == nullptr)
+			{
+				//sealed bindings only change through a fork below them
+				if (env->m_sealed) return nullptr;
+				itr->second = obj;
+				return &(*itr);
+			}
+			bucket = fork->get_bucket(sym);
+			bucket->emplace_back(sym, obj);
+			return &bucket->back();
+		}
+		if (env->m_fork && fork == nullptr) fork = env;
+		env = env->get_parent().get();
+		if (env == nullptr) return nullptr;
+	}
 }
 
 std::shared_ptr<Lisp_Obj> Lisp_Env::get(const std::shared_ptr<Lisp_Symbol> &sym)
@@ -383,16 +540,72 @@ void Lisp_Function::print(std::ostream &out) const
 	out << "<function>";
 }
 
+//////////////
+//Lisp_IStream
+//////////////
+
+int Lisp_IStream::read_char()
+{
+	return get();
+}
+
+size_t Lisp_IStream::read_chars(char *data, size_t len)
+{
+	//copies straight out of the span, short only at the end of input
+	auto start = data;
+	while (len && (m_pos != m_end || refill()))
+	{
+		auto n = std::min(len, (size_t)(m_end - m_pos));
+		memcpy(data, m_pos, n);
+		m_pos += n;
+		data += n;
+		len -= n;
+	}
+	return data - start;
+}
+
+bool Lisp_IStream::read_line(std::string &line)
+{
+	//false at the end of input, the line is cut straight out of the span, a
+	//nonblocking stream keeps a partial line buffered until its '\n' or the
+	//real end is in
+	auto state = false;
+	auto found = false;
+	line.clear();
+	mark();
+	while (m_pos != m_end || refill())
+	{
+		state = true;
+		auto nl = (const char*)memchr(m_pos, '\n', m_end - m_pos);
+		auto stop = nl ? nl : m_end;
+		line.append(m_pos, stop);
+		m_pos = stop;
+		if (nl)
+		{
+			m_pos++;
+			found = true;
+			break;
+		}
+	}
+	if (m_waiting && !found)
+	{
+		rewind();
+		line.clear();
+		return false;
+	}
+	unmark();
+	return state;
+}
+
 /////////////////
 //Lisp_Sys_Stream
 /////////////////
 
-Lisp_Sys_Stream::Lisp_Sys_Stream(std::istream &in)
+Lisp_Sys_Stream::Lisp_Sys_Stream(std::istream &in, int fd)
 	: Lisp_IStream()
 	, m_stream(in)
-{
-	m_stream >> std::noskipws;
-}
+	, m_fd(fd)
+{}
 
 void Lisp_Sys_Stream::print(std::ostream &out) const
 {
@@ -404,34 +617,89 @@ bool Lisp_Sys_Stream::is_open() const
 	return true;
 }
 
-std::istream &Lisp_Sys_Stream::get_stream()
+bool Lisp_Sys_Stream::refill()
 {
-	return m_stream;
+	//a line at a time, so a terminal never has to give more than it has
+	if (!std::getline(m_stream, m_buf, '\n')) return false;
+	if (!m_stream.eof()) m_buf.push_back('\n');
+	m_pos = m_buf.data();
+	m_end = m_pos + m_buf.size();
+	m_offset += m_buf.size();
+	return m_pos != m_end;
 }
 
-int Lisp_Sys_Stream::read_char()
+bool Lisp_Sys_Stream::ready()
 {
-	return m_stream.get();
+	return m_pos != m_end || m_stream.rdbuf()->in_avail() > 0;
 }
 
-std::string Lisp_Sys_Stream::read_line(bool &state)
+long long Lisp_Sys_Stream::avail()
 {
-	std::string line;
-	state = true;
-	if (std::getline(m_stream, line, '\n')) return line;
-	state = false;
-	return line;
+	return (m_end - m_pos) + std::max((long long)m_stream.rdbuf()->in_avail(), 0ll);
+}
+
+int Lisp_Sys_Stream::poll_fd() const
+{
+	return m_fd;
 }
 
 //////////////////
 //Lisp_File_IStream
 //////////////////
 
-Lisp_File_IStream::Lisp_File_IStream(const std::string &path)
+Lisp_File_IStream::Lisp_File_IStream(const std::string &path, bool nonblock)
 	: Lisp_IStream()
+	, m_path(path)
+	, m_nonblock(nonblock)
+{
+#ifdef _WIN64
+	m_fd = open(path.c_str(), O_RDONLY);
+#else
+	//a fifo opened without blocking doesn't wait here for a writer
+	m_fd = open(path.c_str(), nonblock ? O_RDONLY | O_NONBLOCK : O_RDONLY);
+#endif
+	map();
+}
+
+Lisp_File_IStream::Lisp_File_IStream(int fd)
+	: Lisp_IStream()
+	, m_nonblock(true)
+{
+	//our own descriptor, the flags stay shared so refill never blocks
+	//by polling first rather than by setting O_NONBLOCK under someone else
+	//reads carry on from the descriptor's own position, a chunk at a time
+	m_fd = dup(fd);
+}
+
+void Lisp_File_IStream::map()
+{
+#ifndef _WIN64
+	//regular files are mapped from the current offset to the end and read in
+	//place, then reads carry on from the descriptor so appended bytes are
+	//seen, anything else is read a chunk at a time
+	struct stat fs;
+	if (m_fd == -1 || fstat(m_fd, &fs) != 0 || !S_ISREG(fs.st_mode)) return;
+	auto off = lseek(m_fd, 0, SEEK_CUR);
+	if (off < 0 || off >= fs.st_size) return;
+	auto base = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	auto map = mmap(nullptr, fs.st_size - base, PROT_READ, MAP_PRIVATE, m_fd, base);
+	if (map == MAP_FAILED) return;
+	madvise(map, fs.st_size - base, MADV_SEQUENTIAL);
+	m_map = (char*)map;
+	m_map_size = fs.st_size - base;
+	m_pos = m_map + (off - base);
+	m_end = m_map + m_map_size;
+	m_offset = fs.st_size - off;
+	m_resume = fs.st_size;
+#endif
+}
+
+Lisp_File_IStream::~Lisp_File_IStream()
 {
-	m_stream.open(path, std::ifstream::in);
-	m_stream >> std::noskipws;
+#ifndef _WIN64
+	if (m_map) munmap(m_map, m_map_size);
+#endif
+	if (m_fd != -1) close(m_fd);
 }
 
 void Lisp_File_IStream::print(std::ostream &out) const
@@ -441,44 +709,204 @@ void Lisp_File_IStream::print(std::ostream &out) const
 
 bool Lisp_File_IStream::is_open() const
 {
-	return m_stream.is_open();
+	return m_fd != -1;
 }
 
-std::istream &Lisp_File_IStream::get_stream()
+bool Lisp_File_IStream::refill()
 {
-	return m_stream;
+	if (m_fd == -1) return false;
+#ifndef _WIN64
+	if (m_resume >= 0)
+	{
+		if (lseek(m_fd, m_resume, SEEK_SET) < 0) return false;
+		m_resume = -1;
+	}
+#endif
+	if (!m_nonblock || m_mark < 0)
+	{
+		//an io stream with nothing waiting reads as the end for now
+		if (m_nonblock && !ready())
+		{
+			m_waiting = true;
+			return false;
+		}
+		if (m_buf.empty()) m_buf.resize(istream_chunk_size);
+		auto len = ::read(m_fd, &m_buf[0], m_buf.size());
+		if (len <= 0)
+		{
+			m_waiting = len < 0 && errno == EAGAIN;
+			return false;
+		}
+		m_pos = &m_buf[0];
+		m_end = m_pos + len;
+		m_offset += len;
+		return true;
+	}
+
+	//marked, everything from the mark moves to the front and is read after
+	auto keep = (size_t)(m_offset - m_mark);
+	auto from = m_end - keep;
+	if (!m_buf.empty() && from >= m_buf.data() && from <= m_buf.data() + m_buf.size())
+		memmove(m_buf.data(), from, keep);
+	else
+	{
+		std::vector<char> buf(from, m_end);
+		m_buf.swap(buf);
+	}
+	m_buf.resize(std::max(m_buf.size(), keep + istream_chunk_size));
+	m_pos = m_end = m_buf.data() + keep;
+	if (!ready())
+	{
+		m_waiting = true;
+		return false;
+	}
+	auto len = ::read(m_fd, m_buf.data() + keep, m_buf.size() - keep);
+	if (len <= 0)
+	{
+		m_waiting = len < 0 && errno == EAGAIN;
+		return false;
+	}
+	m_end += len;
+	m_offset += len;
+	return true;
 }
 
-int Lisp_File_IStream::read_char()
+bool Lisp_File_IStream::ready()
 {
-	return m_stream.get();
+	if (m_pos != m_end || m_fd == -1 || m_map) return true;
+#ifdef _WIN64
+	return true;
+#else
+	struct pollfd fds = {m_fd, POLLIN, 0};
+	return poll(&fds, 1, 0) > 0;
+#endif
+}
+
+long long Lisp_File_IStream::avail()
+{
+	auto n = (long long)(m_end - m_pos);
+#ifndef _WIN64
+	auto pending = 0;
+	if (m_fd != -1 && !m_map && ioctl(m_fd, FIONREAD, &pending) == 0) n += pending;
+#endif
+	return n;
+}
+
+int Lisp_File_IStream::poll_fd() const
+{
+	return m_map ? -1 : m_fd;
+}
+
+/////////////////////
+//Lisp_String_IStream
+/////////////////////
+
+Lisp_String_IStream::Lisp_String_IStream(const std::shared_ptr<Lisp_String> &s)
+	: Lisp_IStream()
+	, m_string(s)
+{
+	//reads in place, strings are never changed once made
+	m_pos = m_string->m_string.data();
+	m_end = m_pos + m_string->m_string.size();
+	m_offset = m_string->m_string.size();
+}
+
+void Lisp_String_IStream::print(std::ostream &out) const
+{
+	out << "<string istream>";
+}
+
+bool Lisp_String_IStream::is_open() const
+{
+	return true;
+}
+
+bool Lisp_String_IStream::refill()
+{
+	return false;
 }
 
-std::string Lisp_File_IStream::read_line(bool &state)
+bool Lisp_String_IStream::ready()
 {
-	std::string line;
-	state = true;
-	if (std::getline(m_stream, line, '\n')) return line;
-	state = false;
-	return line;
+	return true;
+}
+
+//////////////
+//Lisp_OStream
+//////////////
+
+void Lisp_OStream::write_all(const std::shared_ptr<Lisp_List> &lst)
+{
+	for (auto &&o : lst->m_v)
+	{
+		auto &s = std::static_pointer_cast<Lisp_String>(o)->m_string;
+		write_chars(s.data(), s.size());
+	}
 }
 
 //////////////////
 //Lisp_File_OStream
 //////////////////
 
+static int fd_write(int fd, const char *data, size_t len)
+{
+	while (len)
+	{
+		auto n = ::write(fd, data, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return n < 0 ? errno : EIO;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//open file ostreams, flushed at exit, even by exit() with them still bound
+struct Lisp_OStreams
+{
+	std::mutex m_mutex;
+	std::unordered_set<Lisp_File_OStream*> m_streams;
+};
+
+static Lisp_OStreams &ostreams()
+{
+	//never destroyed, streams can outlive every static
+	static auto streams = new Lisp_OStreams;
+	return *streams;
+}
+
+void ostream_flush_all()
+{
+	auto &o = ostreams();
+	std::lock_guard<std::mutex> lock(o.m_mutex);
+	for (auto &&s : o.m_streams) s->flush();
+}
+
 Lisp_File_OStream::Lisp_File_OStream(const std::string &path, int mode)
 	: Lisp_OStream()
 {
-	if (mode == 1) m_stream.open(path, std::ofstream::out);
-	else m_stream.open(path, std::ofstream::out | std::ios_base::app);
-	if (!m_stream.is_open())
+	auto flags = O_WRONLY | O_CREAT | (mode == 1 ? O_TRUNC : O_APPEND);
+	m_fd = open(path.c_str(), flags, 0666);
+	if (m_fd == -1)
 	{
 		rmkdir(path.data());
-		if (mode == 1) m_stream.open(path, std::ofstream::out);
-		else m_stream.open(path, std::ofstream::out | std::ios_base::app);
+		m_fd = open(path.c_str(), flags, 0666);
 	}
-	m_stream << std::noskipws;
+	m_buf.reserve(ostream_buffer_size);
+	auto &o = ostreams();
+	std::lock_guard<std::mutex> lock(o.m_mutex);
+	o.m_streams.insert(this);
+}
+
+Lisp_File_OStream::~Lisp_File_OStream()
+{
+	{
+		auto &o = ostreams();
+		std::lock_guard<std::mutex> lock(o.m_mutex);
+		o.m_streams.erase(this);
+	}
+	flush();
+	if (m_fd != -1) close(m_fd);
 }
 
 void Lisp_File_OStream::print(std::ostream &out) const
@@ -488,22 +916,88 @@ void Lisp_File_OStream::print(std::ostream &out) const
 
 bool Lisp_File_OStream::is_open() const
 {
-	return m_stream.is_open();
+	return m_fd != -1;
 }
 
-std::ostream &Lisp_File_OStream::get_stream()
+void Lisp_File_OStream::write_char(int c)
 {
-	return m_stream;
+	m_buf.push_back(c);
+	if (m_buf.size() >= ostream_buffer_size) flush();
 }
 
-void Lisp_File_OStream::write_char(int c)
+void Lisp_File_OStream::write_line(const std::string &s)
 {
-	m_stream.put(c);
+	write_chars(s.data(), s.size());
 }
 
-void Lisp_File_OStream::write_line(const std::string &s)
+void Lisp_File_OStream::write_chars(const char *data, size_t len)
 {
-	m_stream << s;
+	//big writes skip the buffer once it's been emptied
+	if (m_buf.size() + len > ostream_buffer_size)
+	{
+		flush();
+		if (len >= ostream_buffer_size)
+		{
+			if (m_fd != -1 && !m_error) m_error = fd_write(m_fd, data, len);
+			return;
+		}
+	}
+	m_buf.append(data, len);
+}
+
+void Lisp_File_OStream::write_all(const std::shared_ptr<Lisp_List> &lst)
+{
+	//batches that fit are copied into the buffer, bigger ones go out with
+	//what's buffered in gathered writes
+	if (m_fd == -1 || m_error) return;
+	auto total = m_buf.size();
+	for (auto &&o : lst->m_v) total += std::static_pointer_cast<Lisp_String>(o)->m_string.size();
+	if (total < ostream_buffer_size)
+	{
+		for (auto &&o : lst->m_v) m_buf.append(std::static_pointer_cast<Lisp_String>(o)->m_string);
+		return;
+	}
+#ifdef _WIN64
+	flush();
+	for (auto &&o : lst->m_v)
+	{
+		auto &s = std::static_pointer_cast<Lisp_String>(o)->m_string;
+		if (!m_error) m_error = fd_write(m_fd, s.data(), s.size());
+	}
+#else
+	std::vector<struct iovec> iov;
+	iov.reserve(lst->m_v.size() + 1);
+	if (!m_buf.empty()) iov.push_back({&m_buf[0], m_buf.size()});
+	for (auto &&o : lst->m_v)
+	{
+		auto &s = std::static_pointer_cast<Lisp_String>(o)->m_string;
+		if (!s.empty()) iov.push_back({(void*)s.data(), s.size()});
+	}
+	for (size_t i = 0; i < iov.size();)
+	{
+		auto n = writev(m_fd, &iov[i], (int)std::min(iov.size() - i, (size_t)IOV_MAX));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			m_error = n < 0 ? errno : EIO;
+			break;
+		}
+		while (i < iov.size() && (size_t)n >= iov[i].iov_len) n -= iov[i++].iov_len;
+		if (i < iov.size())
+		{
+			iov[i].iov_base = (char*)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	m_buf.clear();
+#endif
+}
+
+void Lisp_File_OStream::flush()
+{
+	if (m_buf.empty()) return;
+	if (m_fd != -1 && !m_error) m_error = fd_write(m_fd, m_buf.data(), m_buf.size());
+	m_buf.clear();
 }
 
 ////////////////////
@@ -531,11 +1025,6 @@ bool Lisp_String_Stream::is_open() const
 	return true;
 }
 
-std::ostream &Lisp_String_Stream::get_stream()
-{
-	return m_stream;
-}
-
 void Lisp_String_Stream::write_char(int c)
 {
 	m_stream.put(c);
@@ -546,6 +1035,51 @@ void Lisp_String_Stream::write_line(const std::string &s)
 	m_stream.write(&s[0], s.size());
 }
 
+void Lisp_String_Stream::write_chars(const char *data, size_t len)
+{
+	m_stream.write(data, len);
+}
+
+//////////////
+//Lisp_Mailbox
+//////////////
+
+Lisp_Mailbox::Lisp_Mailbox(size_t capacity)
+	: Lisp_Obj()
+	, m_capacity(capacity)
+{}
+
+void Lisp_Mailbox::print(std::ostream &out) const
+{
+	out << "<mailbox>";
+}
+
+void Lisp_Mailbox::send(Lisp_Message &&msg)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_not_full.wait(lock, [&] { return m_queue.size() < m_capacity; });
+	m_queue.push_back(std::move(msg));
+	lock.unlock();
+	m_not_empty.notify_one();
+}
+
+Lisp_Message Lisp_Mailbox::read()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_not_empty.wait(lock, [&] { return !m_queue.empty(); });
+	auto msg = std::move(m_queue.front());
+	m_queue.pop_front();
+	lock.unlock();
+	m_not_full.notify_one();
+	return msg;
+}
+
+bool Lisp_Mailbox::poll()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return !m_queue.empty();
+}
+
 //////
 //Lisp
 //////
@@ -619,6 +1153,17 @@ Lisp::Lisp()
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("match?")), std::make_shared<Lisp_Function>(&Lisp::match));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("some!")), std::make_shared<Lisp_Function>(&Lisp::some));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("each!")), std::make_shared<Lisp_Function>(&Lisp::each));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("pmap")), std::make_shared<Lisp_Function>(&Lisp::pmap));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("peach!")), std::make_shared<Lisp_Function>(&Lisp::peach));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("task-spawn")), std::make_shared<Lisp_Function>(&Lisp::taskspawn));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("mail-box")), std::make_shared<Lisp_Function>(&Lisp::mailbox));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("mail-send")), std::make_shared<Lisp_Function>(&Lisp::mailsend));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("mail-read")), std::make_shared<Lisp_Function>(&Lisp::mailread));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("mail-poll")), std::make_shared<Lisp_Function>(&Lisp::mailpoll));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("co-spawn")), std::make_shared<Lisp_Function>(&Lisp::cospawn));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("co-yield")), std::make_shared<Lisp_Function>(&Lisp::coyield));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("co-join")), std::make_shared<Lisp_Function>(&Lisp::cojoin));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("build-all")), std::make_shared<Lisp_Function>(&Lisp::buildall));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("pivot")), std::make_shared<Lisp_Function>(&Lisp::part));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("cap")), std::make_shared<Lisp_Function>(&Lisp::cap));
 
@@ -629,18 +1174,32 @@ Lisp::Lisp()
 
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("file-stream")), std::make_shared<Lisp_Function>(&Lisp::filestream));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("string-stream")), std::make_shared<Lisp_Function>(&Lisp::strstream));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("io-stream")), std::make_shared<Lisp_Function>(&Lisp::iostream));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("read")), std::make_shared<Lisp_Function>(&Lisp::read));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("read-all")), std::make_shared<Lisp_Function>(&Lisp::readall));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("read-char")), std::make_shared<Lisp_Function>(&Lisp::readchar));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("read-line")), std::make_shared<Lisp_Function>(&Lisp::readline));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("read-packed")), std::make_shared<Lisp_Function>(&Lisp::readpacked));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("read-avail")), std::make_shared<Lisp_Function>(&Lisp::readavail));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("poll")), std::make_shared<Lisp_Function>(&Lisp::poll));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("write-packed")), std::make_shared<Lisp_Function>(&Lisp::writepacked));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("each-line")), std::make_shared<Lisp_Function>(&Lisp::eachline));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("write")), std::make_shared<Lisp_Function>(&Lisp::write));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("write-line")), std::make_shared<Lisp_Function>(&Lisp::writeline));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("write-all")), std::make_shared<Lisp_Function>(&Lisp::writeall));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("write-char")), std::make_shared<Lisp_Function>(&Lisp::writechar));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("prin")), std::make_shared<Lisp_Function>(&Lisp::prin));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("print")), std::make_shared<Lisp_Function>(&Lisp::print));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("flush")), std::make_shared<Lisp_Function>(&Lisp::flush));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("load")), std::make_shared<Lisp_Function>(&Lisp::load));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("serialize")), std::make_shared<Lisp_Function>(&Lisp::serialize));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("deserialize")), std::make_shared<Lisp_Function>(&Lisp::deserialize));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("save")), std::make_shared<Lisp_Function>(&Lisp::save));
 
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("time")), std::make_shared<Lisp_Function>(&Lisp::time));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("pii-fstat")), std::make_shared<Lisp_Function>(&Lisp::pii_fstat));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("pii-fstat-many")), std::make_shared<Lisp_Function>(&Lisp::pii_fstat_many));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("load-many")), std::make_shared<Lisp_Function>(&Lisp::load_many));
 
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("ffi")), std::make_shared<Lisp_Function>(&Lisp::lambda, 1));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("catch")), std::make_shared<Lisp_Function>(&Lisp::lcatch, 1));
@@ -653,6 +1212,7 @@ Lisp::Lisp()
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("progn")), std::make_shared<Lisp_Function>(&Lisp::progn));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("apply")), std::make_shared<Lisp_Function>(&Lisp::apply));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("eval")), std::make_shared<Lisp_Function>(&Lisp::eval));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("eval-budget")), std::make_shared<Lisp_Function>(&Lisp::evalbudget));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("repl")), std::make_shared<Lisp_Function>(&Lisp::repl));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("type-of")), std::make_shared<Lisp_Function>(&Lisp::type));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("throw")), std::make_shared<Lisp_Function>(&Lisp::lthrow));
@@ -661,6 +1221,8 @@ Lisp::Lisp()
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("defmacro")), std::make_shared<Lisp_Function>(&Lisp::defmacro, 1));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("env")), std::make_shared<Lisp_Function>(&Lisp::env, 0));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("penv")), std::make_shared<Lisp_Function>(&Lisp::penv, 0));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("env-fork")), std::make_shared<Lisp_Function>(&Lisp::envfork, 0));
+	m_env->insert(intern(std::make_shared<Lisp_Symbol>("env-seal")), std::make_shared<Lisp_Function>(&Lisp::envseal, 0));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("defq")), std::make_shared<Lisp_Function>(&Lisp::defq, 1));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("def?")), std::make_shared<Lisp_Function>(&Lisp::defx, 0));
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("setq")), std::make_shared<Lisp_Function>(&Lisp::setq, 1));
@@ -673,4 +1235,19 @@ Lisp::Lisp()
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("bind")), std::make_shared<Lisp_Function>(&Lisp::bind));
 
 	m_env->insert(intern(std::make_shared<Lisp_Symbol>("pii-dirlist")), std::make_shared<Lisp_Function>(&Lisp::piidirlist));
+
+	//builtin table, lets images refer to functions by name
+	for (auto &&bucket : m_env->m_buckets)
+	{
+		for (auto &&p : bucket)
+		{
+			if (p.second->type() == lisp_type_function) m_builtins.push_back(p);
+		}
+	}
+}
+
+Lisp::~Lisp()
+{
+	//coroutines still suspended unwind while the instance is whole
+	co_cancel();
 }
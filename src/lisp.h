@@ -33,6 +33,13 @@
 #include <numeric>
 #include <string>
 #include <chrono>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <climits>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -56,6 +63,9 @@ enum Lisp_Type
 	lisp_type_string_stream = 1 << 8,
 	lisp_type_sys_stream = 1 << 9,
 	lisp_type_error = 1 << 10,
+	lisp_type_mailbox = 1 << 14,
+	lisp_type_coroutine = 1 << 15,
+	lisp_type_string_istream = 1 << 16,
 
 	lisp_type_seq = 1 << 11,
 	lisp_type_istream = 1 << 12,
@@ -68,6 +78,8 @@ const int type_mask_integer = type_mask_obj | lisp_type_integer;
 const int type_mask_seq = type_mask_obj | lisp_type_seq;
 const int type_mask_env = type_mask_obj | lisp_type_env;
 const int type_mask_function = type_mask_obj | lisp_type_function;
+const int type_mask_mailbox = type_mask_obj | lisp_type_mailbox;
+const int type_mask_coroutine = type_mask_obj | lisp_type_coroutine;
 const int type_mask_istream = type_mask_obj | lisp_type_istream;
 const int type_mask_ostream = type_mask_obj | lisp_type_ostream;
 const int type_mask_list = type_mask_seq | lisp_type_list;
@@ -77,6 +89,7 @@ const int type_mask_sys_stream = type_mask_istream | lisp_type_sys_stream;
 const int type_mask_file_istream = type_mask_istream | lisp_type_file_istream;
 const int type_mask_file_ostream = type_mask_ostream | lisp_type_file_ostream;
 const int type_mask_string_stream = type_mask_ostream | lisp_type_string_stream;
+const int type_mask_string_istream = type_mask_istream | lisp_type_string_istream;
 
 enum Lisp_Error_Num
 {
@@ -101,25 +114,39 @@ enum Lisp_Error_Num
 	error_msg_symbol_not_bound,
 	error_msg_wrong_num_of_args,
 	error_msg_wrong_types,
-	error_msg_rebind_constant
+	error_msg_rebind_constant,
+	error_msg_budget_exceeded,
+	error_msg_bad_message,
+	error_msg_dependency_cycle,
+	error_msg_write_error,
+	error_msg_deadlock,
+	error_msg_cancelled
 };
 
 class Lisp;
+class Lisp_Pool;
+class Lisp_Sched;
+class Lisp_Ahead;
 class Lisp_Obj;
 class Lisp_List;
 class Lisp_Symbol;
 
 typedef std::shared_ptr<Lisp_Obj> (Lisp::*lisp_func_ptr)(const std::shared_ptr<Lisp_List> &args);
 
+//objects created on this thread, for allocation budgets
+extern thread_local unsigned long long lisp_obj_allocs;
+
 class Lisp_Obj
 {
 public:
-	Lisp_Obj() {};
+	Lisp_Obj() { ++lisp_obj_allocs; };
 	virtual ~Lisp_Obj() {};
 	virtual const Lisp_Type type() const = 0;
 	virtual std::shared_ptr<Lisp_List> type_of() const { return std::make_shared<Lisp_List>(); }
 	virtual Lisp_Type is_type(Lisp_Type t) const = 0;
 	virtual void print(std::ostream &out) const = 0;
+	//appends the printed form, without going through a stream
+	virtual void print_to(std::string &out) const;
 };
 
 class Lisp_Error : public Lisp_Obj
@@ -143,6 +170,7 @@ public:
 	std::shared_ptr<Lisp_List> type_of() const override;
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_integer); }
 	void print(std::ostream &out) const override;
+	void print_to(std::string &out) const override;
 	long long m_value;
 };
 
@@ -167,6 +195,7 @@ public:
 	std::shared_ptr<Lisp_List> type_of() const override;
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_list); }
 	void print(std::ostream &out) const override;
+	void print_to(std::string &out) const override;
 	long long length() const override;
 	std::shared_ptr<Lisp_Obj> elem(long long i) const override;
 	std::shared_ptr<Lisp_Obj> slice(long long s, long long e) const override;
@@ -179,12 +208,14 @@ class Lisp_String : public Lisp_Seq
 public:
 	Lisp_String();
 	Lisp_String(const std::string &s);
+	Lisp_String(std::string &&s);
 	Lisp_String(char c);
 	Lisp_String(const char *s, int len);
 	const Lisp_Type type() const override { return lisp_type_string; }
 	std::shared_ptr<Lisp_List> type_of() const override;
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_string); }
 	void print(std::ostream &out) const override;
+	void print_to(std::string &out) const override;
 	void print1(std::ostream &out) const;
 	long long length() const override;
 	std::shared_ptr<Lisp_Obj> elem(long long i) const override;
@@ -207,6 +238,7 @@ public:
 	std::shared_ptr<Lisp_List> type_of() const override;
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_symbol); }
 	void print(std::ostream &out) const override;
+	void print_to(std::string &out) const override;
 };
 
 class Lisp_Function : public Lisp_Obj
@@ -227,9 +259,36 @@ public:
 		: Lisp_Obj()
 	{}
 	virtual bool is_open() const = 0;
-	virtual std::istream &get_stream() = 0;
-	virtual int read_char() = 0;
-	virtual std::string read_line(bool &state) = 0;
+	//moves the next chunk of input into [m_pos, m_end), false at the end
+	virtual bool refill() = 0;
+	//input can be taken without blocking
+	virtual bool ready() { return m_pos != m_end; }
+	//bytes that can be taken without blocking
+	virtual long long avail() { return m_end - m_pos; }
+	//descriptor to poll for more input, -1 if there is none to wait on
+	virtual int poll_fd() const { return -1; }
+	int peek() { return (m_pos != m_end || refill()) ? (unsigned char)*m_pos : -1; }
+	int get() { return (m_pos != m_end || refill()) ? (unsigned char)*m_pos++ : -1; }
+	long long tell() const { return m_offset - (m_end - m_pos); }
+	int read_char();
+	bool read_line(std::string &line);
+	size_t read_chars(char *data, size_t len);
+	//a nonblocking stream keeps its input from the mark, so a read that runs
+	//out of waiting input can be taken back and tried again later
+	void mark() { m_mark = tell(); m_mark_line = m_line; m_waiting = false; }
+	void unmark() { m_mark = -1; }
+	void rewind() { m_pos = m_end - (m_offset - m_mark); m_line = m_mark_line; m_mark = -1; }
+	//bytes read up to the end of input go back, ahead of whatever comes later
+	void unread(const char *data, size_t len) { m_unread.assign(data, len); m_pos = m_unread.data(); m_end = m_pos + len; }
+	const char *m_pos = nullptr;
+	const char *m_end = nullptr;
+	long long m_offset = 0;
+	long long m_line = 1;
+	long long m_mark = -1;
+	long long m_mark_line = 1;
+	std::string m_unread;
+	//the last refill found no input waiting, but it hasn't ended
+	bool m_waiting = false;
 };
 
 class Lisp_OStream : public Lisp_Obj
@@ -239,51 +298,86 @@ public:
 		: Lisp_Obj()
 	{}
 	virtual bool is_open() const = 0;
-	virtual std::ostream &get_stream() = 0;
 	virtual void write_char(int c) = 0;
 	virtual void write_line(const std::string &s) = 0;
+	virtual void write_chars(const char *data, size_t len) = 0;
+	virtual void write_all(const std::shared_ptr<Lisp_List> &lst);
+	virtual void flush() {}
+	//errno of the first failed write, what was buffered is dropped
+	int m_error = 0;
 };
 
 class Lisp_Sys_Stream : public Lisp_IStream
 {
 public:
-	Lisp_Sys_Stream(std::istream &in);
+	Lisp_Sys_Stream(std::istream &in, int fd = -1);
 	const Lisp_Type type() const override { return lisp_type_sys_stream; }
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_sys_stream); }
 	void print(std::ostream &out) const override;
 	bool is_open() const override;
-	std::istream &get_stream() override;
-	int read_char() override;
-	std::string read_line(bool &state) override;
+	bool refill() override;
+	bool ready() override;
+	long long avail() override;
+	int poll_fd() const override;
 	std::istream &m_stream;
+	std::string m_buf;
+	int m_fd;
 };
 
 class Lisp_File_IStream : public Lisp_IStream
 {
 public:
-	Lisp_File_IStream(const std::string &path);
+	Lisp_File_IStream(const std::string &path, bool nonblock = false);
+	Lisp_File_IStream(int fd);
 	const Lisp_Type type() const override { return lisp_type_file_istream; }
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_file_istream); }
 	void print(std::ostream &out) const override;
+	~Lisp_File_IStream();
+	bool is_open() const override;
+	bool refill() override;
+	bool ready() override;
+	long long avail() override;
+	int poll_fd() const override;
+	void map();
+	std::vector<char> m_buf;
+	std::string m_path;
+	char *m_map = nullptr;
+	size_t m_map_size = 0;
+	//file offset reads carry on from once the mapping is used up
+	long long m_resume = -1;
+	int m_fd;
+	bool m_nonblock = false;
+};
+
+class Lisp_String_IStream : public Lisp_IStream
+{
+public:
+	Lisp_String_IStream(const std::shared_ptr<Lisp_String> &s);
+	const Lisp_Type type() const override { return lisp_type_string_istream; }
+	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_string_istream); }
+	void print(std::ostream &out) const override;
 	bool is_open() const override;
-	std::istream &get_stream() override;
-	int read_char() override;
-	std::string read_line(bool &state) override;
-	std::ifstream m_stream;
+	bool refill() override;
+	bool ready() override;
+	std::shared_ptr<Lisp_String> m_string;
 };
 
 class Lisp_File_OStream : public Lisp_OStream
 {
 public:
 	Lisp_File_OStream(const std::string &path, int mode);
+	~Lisp_File_OStream();
 	const Lisp_Type type() const override { return lisp_type_file_ostream; }
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_file_ostream); }
 	void print(std::ostream &out) const override;
 	bool is_open() const override;
-	std::ostream &get_stream() override;
 	void write_char(int c) override;
 	void write_line(const std::string &s) override;
-	std::ofstream m_stream;
+	void write_chars(const char *data, size_t len) override;
+	void write_all(const std::shared_ptr<Lisp_List> &lst) override;
+	void flush() override;
+	std::string m_buf;
+	int m_fd;
 };
 
 class Lisp_String_Stream : public Lisp_OStream
@@ -295,12 +389,36 @@ public:
 	void print(std::ostream &out) const override;
 	void print1(std::ostream &out) const;
 	bool is_open() const override;
-	std::ostream &get_stream() override;
 	void write_char(int c) override;
 	void write_line(const std::string &s) override;
+	void write_chars(const char *data, size_t len) override;
 	std::ostringstream m_stream;
 };
 
+//serialized object graph, handles carry thread safe objects by reference
+struct Lisp_Message
+{
+	std::string m_data;
+	std::vector<std::shared_ptr<Lisp_Obj>> m_handles;
+};
+
+class Lisp_Mailbox : public Lisp_Obj
+{
+public:
+	Lisp_Mailbox(size_t capacity);
+	const Lisp_Type type() const override { return lisp_type_mailbox; }
+	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_mailbox); }
+	void print(std::ostream &out) const override;
+	void send(Lisp_Message &&msg);
+	Lisp_Message read();
+	bool poll();
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+	std::deque<Lisp_Message> m_queue;
+	size_t m_capacity;
+};
+
 typedef std::pair<std::shared_ptr<Lisp_Symbol>, std::shared_ptr<Lisp_Obj>> Lisp_Env_Pair;
 typedef std::vector<Lisp_Env_Pair> Lisp_Env_Bucket;
 typedef std::vector<Lisp_Env_Bucket> Lisp_Env_Buckets;
@@ -312,6 +430,7 @@ public:
 	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_env); }
 	std::shared_ptr<Lisp_List> type_of() const override;
 	void print(std::ostream &out) const override;
+	void print_to(std::string &out) const override;
 	void set_parent(const std::shared_ptr<Lisp_Env> &env);
 	std::shared_ptr<Lisp_Env> get_parent() const;
 	Lisp_Env_Pair *find(const std::shared_ptr<Lisp_Symbol> &sym);
@@ -323,6 +442,20 @@ public:
 	Lisp_Env_Buckets::iterator get_bucket(const std::shared_ptr<Lisp_Symbol> &sym);
 	Lisp_Env_Buckets m_buckets;
 	std::shared_ptr<Lisp_Env> m_parent;
+	bool m_fork = false;
+	bool m_sealed = false;
+};
+
+//evaluation limits set by eval-budget, steps not yet handed out to the
+//eval tick counter, a deadline and an absolute allocation count
+struct Lisp_Budget
+{
+	long long m_steps = 0;
+	std::chrono::steady_clock::time_point m_deadline;
+	unsigned long long m_allocs = 0;
+	bool m_step_limit = false;
+	bool m_time_limit = false;
+	bool m_alloc_limit = false;
 };
 
 struct Intern_Cmp
@@ -334,27 +467,55 @@ struct Intern_Cmp
 };
 
 //lisp class
+//independent Lisp instances may evaluate on different threads at the same
+//time, the only state they share is the interned symbol table, which is
+//locked, and the read only arg_v verbosity set up before any instance runs.
+//A single instance, and the objects it creates, belong to one thread
 class Lisp
 {
 public:
 	Lisp();
+	~Lisp();
 
 	void env_push();
 	void env_pop();
 	std::shared_ptr<Lisp_Obj> env_bind(const std::shared_ptr<Lisp_Obj> &lst, const std::shared_ptr<Lisp_Obj> &seq);
-
-	int repl_read_char(std::istream &in) const;
-	int repl_read_whitespace(std::istream &in) const;
+	std::shared_ptr<Lisp_Env> env_root() const;
+	std::shared_ptr<Lisp_Env> env_fork(const std::shared_ptr<Lisp_Env> &env) const;
+	std::shared_ptr<Lisp_Env> env_overlay(const std::shared_ptr<Lisp_Env> &env) const;
+	std::shared_ptr<Lisp_Env> env_closure(const std::shared_ptr<Lisp_Obj> &obj) const;
+	std::shared_ptr<Lisp_Obj> env_write_error(const std::string &msg, const std::shared_ptr<Lisp_Env> &env,
+		const std::shared_ptr<Lisp_Symbol> &sym, const std::shared_ptr<Lisp_List> &args);
+
+	int repl_read_whitespace(Lisp_IStream &in) const;
 	int repl_expand(std::shared_ptr<Lisp_Obj> &obj, int cnt);
-	std::shared_ptr<Lisp_Obj> repl_read_string(std::istream &in, char term) const;
-	std::shared_ptr<Lisp_Obj> repl_read_symbol(std::istream &in);
-	std::shared_ptr<Lisp_Obj> repl_read_number(std::istream &in);
-	std::shared_ptr<Lisp_Obj> repl_read_list(std::istream &in);
-	std::shared_ptr<Lisp_Obj> repl_read_rmacro(std::istream &in, const std::shared_ptr<Lisp_Symbol> &sym);
-	std::shared_ptr<Lisp_Obj> repl_read(std::istream &in);
+	std::shared_ptr<Lisp_Obj> repl_read_string(Lisp_IStream &in, char term) const;
+	std::shared_ptr<Lisp_Obj> repl_read_symbol(Lisp_IStream &in);
+	std::shared_ptr<Lisp_Obj> repl_read_number(Lisp_IStream &in);
+	std::shared_ptr<Lisp_Obj> repl_read_list(Lisp_IStream &in);
+	std::shared_ptr<Lisp_Obj> repl_read_rmacro(Lisp_IStream &in, const std::shared_ptr<Lisp_Symbol> &sym);
+	std::shared_ptr<Lisp_Obj> repl_read(Lisp_IStream &in);
 	std::shared_ptr<Lisp_Obj> repl_apply(const std::shared_ptr<Lisp_Obj> &func, const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> repl_eval(const std::shared_ptr<Lisp_Obj> &obj);
 	std::shared_ptr<Lisp_Obj> repl_error(const std::string &msg, int type, const std::shared_ptr<Lisp_Obj> &o);
+	std::shared_ptr<Lisp_Obj> budget_check(const std::shared_ptr<Lisp_Obj> &o);
+
+	std::string serial_write(const std::shared_ptr<Lisp_Obj> &obj) const;
+	std::shared_ptr<Lisp_Obj> serial_read(const char *data, size_t len);
+	Lisp_Message mail_pack(const std::shared_ptr<Lisp_Obj> &obj, const std::shared_ptr<Lisp_Env> &closure = nullptr) const;
+	std::shared_ptr<Lisp_Obj> mail_unpack(const Lisp_Message &msg);
+	bool image_save(const std::string &path) const;
+	bool image_load(const std::string &path);
+	std::shared_ptr<Lisp_Pool> pool();
+	std::vector<std::shared_ptr<Lisp_Obj>> par_apply(const char *usage, long long start, long long end,
+		const std::shared_ptr<Lisp_Obj> &func, const std::shared_ptr<Lisp_List> &seqs);
+	std::shared_ptr<Lisp_List> cache_load(const std::string &path, unsigned long long &hash);
+	std::shared_ptr<Lisp_Obj> co_wait(Lisp_IStream &in);
+	void co_cancel();
+	std::shared_ptr<Lisp_Ahead> ahead_start(const std::shared_ptr<Lisp_IStream> &in, const std::string &name);
+	std::shared_ptr<Lisp_Obj> ahead_read(const std::shared_ptr<Lisp_Ahead> &ahead);
+	std::shared_ptr<Lisp_Obj> build_one(const std::shared_ptr<Lisp_Env> &target, const std::string &path);
+	void cache_save(const std::string &path, unsigned long long hash, const std::shared_ptr<Lisp_List> &forms) const;
 
 	std::shared_ptr<Lisp_Obj> add(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> sub(const std::shared_ptr<Lisp_List> &args);
@@ -400,6 +561,18 @@ public:
 	std::shared_ptr<Lisp_Obj> match(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> some(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> each(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> pmap(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> peach(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> taskspawn(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> mailbox(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> mailsend(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> mailread(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> mailpoll(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> cospawn(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> coyield(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> cojoin(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> buildall(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> readall(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> part(const std::shared_ptr<Lisp_List> &args);
 
 	std::shared_ptr<Lisp_Obj> cmp(const std::shared_ptr<Lisp_List> &args);
@@ -409,19 +582,32 @@ public:
 
 	std::shared_ptr<Lisp_Obj> filestream(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> strstream(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> iostream(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> read(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> readchar(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> readline(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> readpacked(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> writepacked(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> readavail(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> poll(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> eachline(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> write(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> writeline(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> writeall(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> flush(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> writechar(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> prin(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> print(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> repl(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> save(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> load(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> serialize(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> deserialize(const std::shared_ptr<Lisp_List> &args);
 
 	std::shared_ptr<Lisp_Obj> time(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> pii_fstat(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> pii_fstat_many(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> load_many(const std::shared_ptr<Lisp_List> &args);
 
 	std::shared_ptr<Lisp_Obj> quote(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> qquote(const std::shared_ptr<Lisp_List> &args);
@@ -430,6 +616,7 @@ public:
 	std::shared_ptr<Lisp_Obj> cond(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> lwhile(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> eval(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> evalbudget(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> lcatch(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> type(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> lthrow(const std::shared_ptr<Lisp_List> &args);
@@ -437,6 +624,8 @@ public:
 
 	std::shared_ptr<Lisp_Obj> env(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> penv(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> envfork(const std::shared_ptr<Lisp_List> &args);
+	std::shared_ptr<Lisp_Obj> envseal(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> defq(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> defx(const std::shared_ptr<Lisp_List> &args);
 	std::shared_ptr<Lisp_Obj> setq(const std::shared_ptr<Lisp_List> &args);
@@ -470,6 +659,21 @@ public:
 	std::shared_ptr<Lisp_Symbol> m_sym_stream_line;
 	std::shared_ptr<Lisp_Symbol> m_sym_file_includes;
 	unsigned long m_next_sym = 0;
+	unsigned long long m_seed = 1234567890;
+	std::vector<Lisp_Env_Pair> m_builtins;
+	std::string m_cache_dir;
+	std::shared_ptr<Lisp_Pool> m_pool;
+	std::shared_ptr<Lisp_Sched> m_sched;
+	//stream the repl is reading, its line goes to *stream_line* per form
+	Lisp_IStream *m_read_stream = nullptr;
+	Lisp_Budget m_budget;
+	long long m_tick = LLONG_MAX;
+	std::vector<std::shared_ptr<Lisp>> m_readers;
+	int m_parse_ahead = 0;
+	int m_pool_size = std::thread::hardware_concurrency();
+	//print flushes stdout every this many lines, 0 only when the buffer fills
+	int m_flush_lines = 0;
+	int m_print_lines = 0;
 	friend void qquote1(Lisp *lisp, const std::shared_ptr<Lisp_Obj> &o, std::shared_ptr<Lisp_List> &cat_list);
 };
 
@@ -20,9 +20,17 @@
 
 #include "lisp.h"
 #include <deque>
+#include <cstdio>
+#ifndef _WIN64
+	#include <unistd.h>
+#endif
 
 int arg_v = 0;
 
+int lisp_daemon(Lisp &lisp, const std::string &path, int max_children);
+int lisp_workers(Lisp &lisp, std::deque<std::string> &jobs, int num_workers);
+void ostream_flush_all();
+
 void ss_reset(std::stringstream &ss, std::string s)
 {
 	ss.str(s);
@@ -31,9 +39,26 @@ void ss_reset(std::stringstream &ss, std::string s)
 
 int main(int argc, char *argv[])
 {
+	//registered first so it runs last, after the tasks are joined
+	std::atexit(ostream_flush_all);
+	//stdout to a file or pipe gets a big buffer, a terminal stays line buffered
+#ifndef _WIN64
+	if (!isatty(1)) setvbuf(stdout, nullptr, _IOFBF, 64 * 1024);
+#endif
+
 	//process comand args
 	auto in_files = std::deque<std::string>{};
 	auto arg_b = "src/boot.inc";
+	auto arg_s = "";
+	auto arg_i = "";
+	auto arg_c = "";
+	auto arg_d = "";
+	auto arg_j = 0;
+	auto arg_m = 64;
+	auto arg_t = -1;
+	auto arg_p = 0;
+	auto arg_r = 0;
+	auto arg_l = 0;
 
 	std::stringstream ss;
 	for (auto i = 1; i < argc; ++i)
@@ -47,6 +72,16 @@ int main(int argc, char *argv[])
 			ss_reset(ss, argv[i]);
 			if (opt == "v") ss >> arg_v;
 			else if (opt == "b") arg_b = argv[i];
+			else if (opt == "s") arg_s = argv[i];
+			else if (opt == "i") arg_i = argv[i];
+			else if (opt == "c") arg_c = argv[i];
+			else if (opt == "d") arg_d = argv[i];
+			else if (opt == "j") ss >> arg_j;
+			else if (opt == "m") ss >> arg_m;
+			else if (opt == "t") ss >> arg_t;
+			else if (opt == "p") ss >> arg_p;
+			else if (opt == "r") ss >> arg_r;
+			else if (opt == "l") ss >> arg_l;
 			else
 			{
 			help:
@@ -54,6 +89,16 @@ int main(int argc, char *argv[])
 				std::cout << "reads from stdin if no filename.\n";
 				std::cout << "-v:  verbosity level 0..1, default 0\n";
 				std::cout << "-b:  boot file, default 'src/boot.inc'\n";
+				std::cout << "-s:  save a booted image to this file after the file list and exit\n";
+				std::cout << "-i:  start from this image file instead of the boot file\n";
+				std::cout << "-c:  cache directory for parsed source files, default none\n";
+				std::cout << "-d:  serve scripts or forms on this unix socket after the file list\n";
+				std::cout << "-m:  most -d requests served at once, default 64\n";
+				std::cout << "-j:  run the file list as jobs on this many forked workers and exit\n";
+				std::cout << "-t:  threads used by pmap and peach!, default all cores\n";
+				std::cout << "-p:  forms parsed ahead of evaluation for files, default 0 off\n";
+				std::cout << "-r:  1 seals the booted root env and runs everything after in an overlay, default 0\n";
+				std::cout << "-l:  flush stdout every this many printed lines, default 0 only when full\n";
 				exit(0);
 			}
 		}
@@ -66,18 +111,44 @@ int main(int argc, char *argv[])
 
 	//repl
 	auto lisp = Lisp();
-	auto stream = std::make_shared<Lisp_File_IStream>(arg_b);
-	if (!stream->is_open())
+	lisp.m_cache_dir = arg_c;
+	if (arg_t >= 0) lisp.m_pool_size = arg_t;
+	lisp.m_parse_ahead = arg_p;
+	lisp.m_flush_lines = arg_l;
+	auto args = std::make_shared<Lisp_List>();
+	auto boot = std::static_pointer_cast<Lisp_Obj>(lisp.m_sym_nil);
+	if (*arg_i)
 	{
-		std::cout << "No such boot file: " << arg_b << std::endl;
-		exit(0);
+		if (!lisp.image_load(arg_i))
+		{
+			std::cout << "No such image file: " << arg_i << std::endl;
+			exit(0);
+		}
 	}
-	auto args = std::make_shared<Lisp_List>();
-	args->m_v.push_back(stream);
-	args->m_v.push_back(std::make_shared<Lisp_String>(arg_b));
-	if (lisp.repl(args) == lisp.m_sym_nil)
+	else
+	{
+		auto stream = std::make_shared<Lisp_File_IStream>(arg_b);
+		if (!stream->is_open())
+		{
+			std::cout << "No such boot file: " << arg_b << std::endl;
+			exit(0);
+		}
+		args->m_v.push_back(stream);
+		args->m_v.push_back(std::make_shared<Lisp_String>(arg_b));
+		boot = lisp.repl(args);
+	}
+	if (boot == lisp.m_sym_nil)
 	{
+		//a sealed root is shared by pointer with worker threads, its bindings
+		//can't change but the values bound are not frozen
+		if (arg_r)
+		{
+			lisp.env_root()->m_sealed = true;
+			lisp.m_env = lisp.env_overlay(lisp.m_env);
+		}
 		std::cout << "\n;;;;;;;;;;;;;;;;;;\n; C++ ChrysaLisp ;\n;;;;;;;;;;;;;;;;;;\n" << std::endl;
+		//from file list, in parallel
+		if (arg_j > 0) exit(lisp_workers(lisp, in_files, arg_j));
 		//from file list
 		while (!in_files.empty())
 		{
@@ -100,8 +171,16 @@ int main(int argc, char *argv[])
 				exit(0);
 			}
 		}
+		//save image
+		if (*arg_s)
+		{
+			if (!lisp.image_save(arg_s)) std::cout << "Can't save image file: " << arg_s << std::endl;
+			exit(0);
+		}
+		//serve requests
+		if (*arg_d) exit(lisp_daemon(lisp, arg_d, arg_m));
 		//from stdin
-		auto stream = std::make_shared<Lisp_Sys_Stream>(std::cin);
+		auto stream = std::make_shared<Lisp_Sys_Stream>(std::cin, 0);
 		auto name = std::make_shared<Lisp_String>("stdin");
 		do
 		{
@@ -14,6 +14,7 @@
 #include <string>
 #include <stdio.h>
 #include <memory>
+#include <atomic>
 #ifdef _WIN64
 	#define _CRT_SECURE_NO_WARNINGS
 	#define DELTA_EPOCH_IN_MICROSECS 11644473600000000Ui64
@@ -28,12 +29,11 @@
 	#include <dirent.h>
 #endif
 
-char dirbuf[1024];
-
 #ifdef _WIN64
 std::string dirlist(const char *path)
 {
 	auto out = std::string{};
+	char dirbuf[1024];
 	size_t path_len = strlen(path);
 	size_t cwd_len = GetCurrentDirectory(1024, dirbuf);
 	HANDLE hFind;
@@ -98,6 +98,44 @@ void rmkdir(const char *path)
 	}
 }
 
+bool file_load(const char *path, std::string &s)
+{
+	//sized from fstat and read straight into the string, pipes and the
+	//like that have no size are read in chunks until the end
+#ifdef _WIN64
+	auto fd = open(path, O_RDONLY | O_BINARY);
+#else
+	auto fd = open(path, O_RDONLY);
+#endif
+	if (fd == -1) return false;
+	struct stat fs;
+	s.clear();
+	if (fstat(fd, &fs) == 0 && S_ISREG(fs.st_mode))
+	{
+		s.resize(fs.st_size);
+		size_t len = 0;
+		while (len < s.size())
+		{
+			auto n = read(fd, &s[len], s.size() - len);
+			if (n <= 0) break;
+			len += n;
+		}
+		s.resize(len);
+	}
+	else
+	{
+		char buf[65536];
+		for (;;)
+		{
+			auto n = read(fd, buf, sizeof(buf));
+			if (n <= 0) break;
+			s.append(buf, n);
+		}
+	}
+	close(fd);
+	return true;
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::piidirlist(const std::shared_ptr<Lisp_List> &args)
 {
 	if (args->length() == 1)
@@ -110,4 +148,84 @@ std::shared_ptr<Lisp_Obj> Lisp::piidirlist(const std::shared_ptr<Lisp_List> &arg
 		return repl_error("(pii-dirlist path)", error_msg_not_a_string, args);
 	}
 	return repl_error("(pii-dirlist path)", error_msg_wrong_num_of_args, args);
-}
\ No newline at end of file
+}
+
+template <class F>
+void io_fan_out(size_t count, F f)
+{
+	//blocking file calls spread over threads, these only touch plain data,
+	//never Lisp objects, so any number can run at once
+	const size_t io_per_thread = 64;
+	const size_t io_max_threads = 16;
+	std::atomic<size_t> next(0);
+	auto work = [&] ()
+	{
+		for (size_t i; (i = next++) < count;) f(i);
+	};
+	auto num_threads = std::min(io_max_threads, (count + io_per_thread - 1) / io_per_thread);
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < num_threads; ++i) threads.emplace_back(work);
+	work();
+	for (auto &&t : threads) t.join();
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::pii_fstat_many(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_list))
+	{
+		auto paths = std::static_pointer_cast<Lisp_List>(args->m_v[0]);
+		if (std::all_of(begin(paths->m_v), end(paths->m_v), [] (auto &&o) { return o->is_type(lisp_type_string); }))
+		{
+			std::vector<struct stat> stats(paths->m_v.size());
+			std::vector<char> found(paths->m_v.size());
+			io_fan_out(paths->m_v.size(), [&] (size_t i)
+			{
+				found[i] = stat(std::static_pointer_cast<Lisp_String>(paths->m_v[i])->m_string.c_str(), &stats[i]) == 0;
+			});
+			auto value = std::make_shared<Lisp_List>();
+			value->m_v.reserve(stats.size());
+			for (auto i = 0u; i < stats.size(); ++i)
+			{
+				if (!found[i])
+				{
+					value->m_v.push_back(m_sym_nil);
+					continue;
+				}
+				auto res = std::make_shared<Lisp_List>();
+				res->m_v.push_back(std::make_shared<Lisp_Integer>(stats[i].st_mtime));
+				res->m_v.push_back(std::make_shared<Lisp_Integer>(stats[i].st_size));
+				res->m_v.push_back(std::make_shared<Lisp_Integer>(stats[i].st_mode));
+				value->m_v.push_back(res);
+			}
+			return value;
+		}
+		return repl_error("(pii-fstat-many paths)", error_msg_not_all_strings, args);
+	}
+	return repl_error("(pii-fstat-many paths)", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::load_many(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_list))
+	{
+		auto paths = std::static_pointer_cast<Lisp_List>(args->m_v[0]);
+		if (std::all_of(begin(paths->m_v), end(paths->m_v), [] (auto &&o) { return o->is_type(lisp_type_string); }))
+		{
+			//the strings are made up front, the threads only fill them
+			auto value = std::make_shared<Lisp_List>();
+			std::vector<char> found(paths->m_v.size());
+			for (auto i = 0u; i < paths->m_v.size(); ++i) value->m_v.push_back(std::make_shared<Lisp_String>());
+			io_fan_out(paths->m_v.size(), [&] (size_t i)
+			{
+				found[i] = file_load(std::static_pointer_cast<Lisp_String>(paths->m_v[i])->m_string.c_str(),
+					std::static_pointer_cast<Lisp_String>(value->m_v[i])->m_string);
+			});
+			for (auto i = 0u; i < found.size(); ++i) if (!found[i]) value->m_v[i] = m_sym_nil;
+			return value;
+		}
+		return repl_error("(load-many paths)", error_msg_not_all_strings, args);
+	}
+	return repl_error("(load-many paths)", error_msg_wrong_types, args);
+}
@@ -22,63 +22,76 @@
 extern int arg_v;
 
 std::shared_ptr<Lisp_Symbol> intern(const std::shared_ptr<Lisp_Symbol> &sym);
+void copy1(std::shared_ptr<Lisp_Obj> &o);
 
-int Lisp::repl_read_char(std::istream &in) const
+int Lisp::repl_read_whitespace(Lisp_IStream &in) const
 {
-	auto c = in.get();
-	if (c == '\n')
+	//skips whitespace and comments, leaves the cursor on the next char
+	for (;;)
 	{
-		auto obj = m_env->get(m_sym_stream_line);
-		if (obj)
+		if (in.m_pos == in.m_end && !in.refill()) return -1;
+		auto c = (unsigned char)*in.m_pos;
+		if (c == ';')
 		{
-			auto num = std::static_pointer_cast<Lisp_Integer>(obj);
-			num->m_value++;
+			for (;;)
+			{
+				auto nl = (const char*)memchr(in.m_pos, '\n', in.m_end - in.m_pos);
+				if (nl)
+				{
+					in.m_pos = nl + 1;
+					in.m_line++;
+					break;
+				}
+				in.m_pos = in.m_end;
+				if (!in.refill()) return -1;
+			}
+			continue;
 		}
+		if (!std::isspace(c)) return c;
+		if (c == '\n') in.m_line++;
+		in.m_pos++;
 	}
-	return c;
-}
-
-int Lisp::repl_read_whitespace(std::istream &in) const
-{
-	int c;
-	for (;;)
-	{
-		c = in.peek();
-		if (c == -1) break;
-		if (!std::isspace(((unsigned char)c))) break;
-		repl_read_char(in);
-	}
-	return c;
 }
 
-std::shared_ptr<Lisp_Obj> Lisp::repl_read_string(std::istream &in, char term) const
+std::shared_ptr<Lisp_Obj> Lisp::repl_read_string(Lisp_IStream &in, char term) const
 {
 	auto obj = std::make_shared<Lisp_String>();
 	//skip '"'
-	in.get();
-	for (;;)
+	in.m_pos++;
+	while (in.m_pos != in.m_end || in.refill())
 	{
-		auto c = repl_read_char(in);
-		if (c == term) break;
-		obj->m_string.push_back(c);
+		auto start = in.m_pos;
+		auto found = (const char*)memchr(start, term, in.m_end - start);
+		auto stop = found ? found : in.m_end;
+		in.m_line += std::count(start, stop, '\n');
+		obj->m_string.append(start, stop);
+		in.m_pos = stop;
+		if (found)
+		{
+			in.m_pos++;
+			break;
+		}
 	}
 	return obj;
 }
 
-std::shared_ptr<Lisp_Obj> Lisp::repl_read_symbol(std::istream &in)
+std::shared_ptr<Lisp_Obj> Lisp::repl_read_symbol(Lisp_IStream &in)
 {
 	auto obj = std::make_shared<Lisp_Symbol>();
-	for (;;)
+	while (in.m_pos != in.m_end || in.refill())
 	{
-		auto p = in.peek();
-		if (p == '(' || p == ')'
-			|| std::isspace(((unsigned char)p))) break;
-		obj->m_string.push_back(in.get());
+		auto start = in.m_pos;
+		auto p = start;
+		while (p != in.m_end && *p != '(' && *p != ')'
+			&& !std::isspace(((unsigned char)*p))) ++p;
+		obj->m_string.append(start, p);
+		in.m_pos = p;
+		if (p != in.m_end) break;
 	}
 	return intern(obj);
 }
 
-std::shared_ptr<Lisp_Obj> Lisp::repl_read_number(std::istream &in)
+std::shared_ptr<Lisp_Obj> Lisp::repl_read_number(Lisp_IStream &in)
 {
 	auto p = in.peek();
 	auto sign = 1;
@@ -140,55 +153,48 @@ std::shared_ptr<Lisp_Obj> Lisp::repl_read_number(std::istream &in)
 	return obj;
 }
 
-std::shared_ptr<Lisp_Obj> Lisp::repl_read_list(std::istream &in)
+std::shared_ptr<Lisp_Obj> Lisp::repl_read_list(Lisp_IStream &in)
 {
 	auto lst = std::make_shared<Lisp_List>();
 	//skip '('
-	in.get();
+	in.m_pos++;
 	for (;;)
 	{
 		auto c = repl_read_whitespace(in);
-		if (c == ')') break;
-		if (c == ';')
+		if (c == -1) break;
+		if (c == ')')
 		{
-			while (repl_read_char(in) != '\n') {}
-			continue;
+			//skip ')'
+			in.m_pos++;
+			break;
 		}
 		lst->m_v.push_back(repl_read(in));
 	}
-	//skip ')'
-	in.get();
 	return lst;
 }
 
-std::shared_ptr<Lisp_Obj> Lisp::repl_read_rmacro(std::istream &in,  const std::shared_ptr<Lisp_Symbol> &sym)
+std::shared_ptr<Lisp_Obj> Lisp::repl_read_rmacro(Lisp_IStream &in,  const std::shared_ptr<Lisp_Symbol> &sym)
 {
 	auto lst = std::make_shared<Lisp_List>();
 	lst->m_v.push_back(sym);
 	//skip '
-	in.get();
+	in.m_pos++;
 	lst->m_v.push_back(repl_read(in));
 	return lst;
 }
 
-std::shared_ptr<Lisp_Obj> Lisp::repl_read(std::istream &in)
+std::shared_ptr<Lisp_Obj> Lisp::repl_read(Lisp_IStream &in)
 {
-	int c;
-	for (;;)
-	{
-		c = repl_read_whitespace(in);
-		if (c != ';') break;
-		while (repl_read_char(in) != '\n') {}
-	}
+	auto c = repl_read_whitespace(in);
 	if (c == -1) return m_sym_nil;
 	if (c == ')')
 	{
-		in.get();
+		in.m_pos++;
 		return repl_error("unexpected )", error_msg, m_sym_nil);
 	}
 	if (c == '}')
 	{
-		in.get();
+		in.m_pos++;
 		return repl_error("unexpected }", error_msg, m_sym_nil);
 	}
 	else if (c == '(') return repl_read_list(in);
@@ -265,9 +271,16 @@ std::shared_ptr<Lisp_Obj> Lisp::repl_error(const std::string &msg, int type, con
 		{"symbol_not_bound"},
 		{"wrong_num_of_args"},
 		{"wrong_types"},
-		{"rebind_constant"}
+		{"rebind_constant"},
+		{"budget_exceeded"},
+		{"bad_message"},
+		{"dependency_cycle"},
+		{"write_error"},
+		{"deadlock"},
+		{"cancelled"}
 	};
 
+	if (m_read_stream) m_env->set(m_sym_stream_line, std::make_shared<Lisp_Integer>(m_read_stream->m_line));
 	auto file = std::static_pointer_cast<Lisp_String>(m_env->get(m_sym_stream_name));
 	auto line = std::static_pointer_cast<Lisp_Integer>(m_env->get(m_sym_stream_line));
 	return std::make_shared<Lisp_Error>(msg + " " + errors[type], file->m_string, line->m_value, o);
@@ -283,13 +296,57 @@ std::shared_ptr<Lisp_Obj> Lisp::repl(const std::shared_ptr<Lisp_List> &args)
 			{
 				auto old_file = m_env->get(m_sym_stream_name);
 				auto old_line = m_env->get(m_sym_stream_line);
+				auto old_read_stream = m_read_stream;
 				m_env->set(m_sym_stream_name, args->m_v[1]);
 				m_env->set(m_sym_stream_line, std::make_shared<Lisp_Integer>(1));
 				auto in = std::static_pointer_cast<Lisp_IStream>(args->m_v[0]);
+				in->m_line = 1;
 				auto obj = std::static_pointer_cast<Lisp_Obj>(m_sym_nil);
+				//file streams can replay read forms from the cache, else record them for it
+				auto file = std::shared_ptr<Lisp_File_IStream>();
+				auto cached = std::shared_ptr<Lisp_List>();
+				auto forms = std::shared_ptr<Lisp_List>();
+				auto index = 0ll;
+				auto hash = 0ull;
+				auto ahead = std::shared_ptr<Lisp_Ahead>();
+				if (!m_cache_dir.empty() && in->type() == lisp_type_file_istream)
+				{
+					file = std::static_pointer_cast<Lisp_File_IStream>(in);
+					if (file->tell() == 0) cached = cache_load(file->m_path, hash);
+					if (!cached) forms = std::make_shared<Lisp_List>();
+				}
+				if (!cached) ahead = ahead_start(in, std::static_pointer_cast<Lisp_String>(args->m_v[1])->m_string);
+				m_read_stream = (cached || ahead) ? nullptr : in.get();
 				do
 				{
-					obj = repl_read(in->get_stream());
+					if (cached)
+					{
+						if (index >= cached->length() - 1)
+						{
+							obj = m_sym_nil;
+							break;
+						}
+						auto line = std::static_pointer_cast<Lisp_Integer>(cached->m_v[index++]);
+						m_env->set(m_sym_stream_line, std::make_shared<Lisp_Integer>(line->m_value));
+						obj = cached->m_v[index++];
+					}
+					else
+					{
+						if (ahead) obj = ahead_read(ahead);
+						else
+						{
+							obj = repl_read(*in);
+							m_env->set(m_sym_stream_line, std::make_shared<Lisp_Integer>(in->m_line));
+						}
+						if (forms && obj != m_sym_nil && obj->type() != lisp_type_error)
+						{
+							auto form = obj;
+							copy1(form);
+							forms->m_v.push_back(std::make_shared<Lisp_Integer>(
+								std::static_pointer_cast<Lisp_Integer>(m_env->get(m_sym_stream_line))->m_value));
+							forms->m_v.push_back(form);
+						}
+					}
 					if (arg_v >= 1)
 					{
 						auto file = std::static_pointer_cast<Lisp_String>(m_env->get(m_sym_stream_name));
@@ -310,10 +367,12 @@ std::shared_ptr<Lisp_Obj> Lisp::repl(const std::shared_ptr<Lisp_List> &args)
 					if (in->type() == lisp_type_sys_stream)
 					{
 						obj->print(std::cout);
-						std::cout << "\n";
-						std::cout << std::endl;
+						std::cout << "\n\n";
 					}
 				} while (obj->type() != lisp_type_error);
+				ahead.reset();
+				m_read_stream = old_read_stream;
+				if (forms && hash && obj == m_sym_nil) cache_save(file->m_path, hash, forms);
 				m_env->set(m_sym_stream_name, old_file);
 				m_env->set(m_sym_stream_line, old_line);
 				return obj;
@@ -370,8 +429,39 @@ std::shared_ptr<Lisp_Obj> Lisp::repl_apply(const std::shared_ptr<Lisp_Obj> &func
 	}
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::budget_check(const std::shared_ptr<Lisp_Obj> &o)
+{
+	//the eval tick ran out, charge the slice to the step budget, check the
+	//clock and allocations, then hand out the next slice
+	const long long budget_slice = 1024;
+	auto &b = m_budget;
+	if (!b.m_step_limit && !b.m_time_limit && !b.m_alloc_limit)
+	{
+		m_tick = LLONG_MAX;
+		return nullptr;
+	}
+	if ((b.m_step_limit && b.m_steps <= 0)
+		|| (b.m_time_limit && std::chrono::steady_clock::now() >= b.m_deadline)
+		|| (b.m_alloc_limit && lisp_obj_allocs >= b.m_allocs))
+	{
+		//stays exhausted, so a catch inside the budget can't keep going
+		m_tick = 0;
+		return repl_error("(eval-budget form steps [usecs [allocs]])", error_msg_budget_exceeded, o);
+	}
+	auto slice = budget_slice;
+	if (b.m_step_limit) slice = std::min(slice, b.m_steps);
+	b.m_steps -= slice;
+	m_tick = slice - 1;
+	return nullptr;
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::repl_eval(const std::shared_ptr<Lisp_Obj> &obj)
 {
+	if (--m_tick < 0)
+	{
+		auto err = budget_check(obj);
+		if (err) return err;
+	}
 	switch (obj->type())
 	{
 		case lisp_type_symbol:
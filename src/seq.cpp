@@ -607,21 +607,21 @@ std::shared_ptr<Lisp_Obj> Lisp::each(const std::shared_ptr<Lisp_List> &args)
 
 std::shared_ptr<Lisp_Obj> Lisp::str(const std::shared_ptr<Lisp_List> &args)
 {
-	std::ostringstream ss;
+	std::string s;
 	for (auto &&o : args->m_v)
 	{
 		switch (o->type())
 		{
 		case lisp_type_string:
-			std::static_pointer_cast<Lisp_String>(o)->print1(ss);
+			s.append(std::static_pointer_cast<Lisp_String>(o)->m_string);
 			break;
 		case lisp_type_string_stream:
-			std::static_pointer_cast<Lisp_String_Stream>(o)->print1(ss);
+			s.append(std::static_pointer_cast<Lisp_String_Stream>(o)->m_stream.str());
 			break;
 		case lisp_type_symbol:
 		default:
-			o->print(ss);
+			o->print_to(s);
 		}
 	}
-	return std::make_shared<Lisp_String>(ss.str());
+	return std::make_shared<Lisp_String>(std::move(s));
 }
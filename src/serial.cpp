@@ -0,0 +1,546 @@
+/*
+    ChrysaLisp++
+    Copyright (C) 2018 Chris Hinsley
+	chris (dot) hinsley (at) gmail (dot) com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lisp.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#ifdef _WIN64
+	#include <process.h>
+#else
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+std::shared_ptr<Lisp_Symbol> intern(const std::shared_ptr<Lisp_Symbol> &sym);
+void rmkdir(const char *path);
+bool file_load(const char *path, std::string &s);
+
+//object graph format, every object with more than one owner is flagged
+//and gets the next id as it is written, any later occurrence is written as
+//a ref, so shared and cyclic structure survives the round trip, objects
+//with one owner can only be met once and take no id, nor does none
+enum Serial_Tag
+{
+	serial_tag_ref,
+	serial_tag_none,
+	serial_tag_integer,
+	serial_tag_string,
+	serial_tag_symbol,
+	serial_tag_list,
+	serial_tag_env,
+	serial_tag_function,
+	serial_tag_error,
+	serial_tag_handle,
+};
+
+const char serial_flag_shared = 0x40;
+
+const char image_magic[] = {'C', 'L', 'P', 'I', 3, 0, 0, 0};
+const char cache_magic[] = {'C', 'L', 'P', 'F', 3, 0, 0, 0};
+//nesting a buffer may have, so crafted input can't run the stack out
+const int serial_max_depth = 8192;
+
+struct Serial_Writer
+{
+	Serial_Writer(const Lisp *lisp, std::string &out, std::vector<std::shared_ptr<Lisp_Obj>> *handles = nullptr)
+		: m_lisp(lisp)
+		, m_out(out)
+		, m_handles(handles)
+	{}
+
+	void write_uint(unsigned long long n)
+	{
+		while (n >= 0x80)
+		{
+			m_out.push_back((char)(n | 0x80));
+			n >>= 7;
+		}
+		m_out.push_back((char)n);
+	}
+
+	void write_int(long long n)
+	{
+		write_uint(((unsigned long long)n << 1) ^ (unsigned long long)(n >> 63));
+	}
+
+	void write_str(const std::string &s)
+	{
+		write_uint(s.size());
+		m_out.append(s);
+	}
+
+	void write(const std::shared_ptr<Lisp_Obj> &o)
+	{
+		//envs the closure stands in for go as the closure, so no chain is
+		//followed past it
+		if (m_closure && m_bound.count(o.get())) return write(m_closure);
+		//only objects with another owner can turn up again
+		auto shared = o.use_count() > 1;
+		if (shared)
+		{
+			auto itr = m_ids.find(o.get());
+			if (itr != end(m_ids))
+			{
+				m_out.push_back(serial_tag_ref);
+				write_uint(itr->second);
+				return;
+			}
+			m_ids.emplace(o.get(), m_next_id++);
+		}
+		auto flag = shared ? serial_flag_shared : 0;
+		switch (o->type())
+		{
+		case lisp_type_integer:
+			m_out.push_back(serial_tag_integer | flag);
+			write_int(std::static_pointer_cast<Lisp_Integer>(o)->m_value);
+			break;
+		case lisp_type_string:
+			m_out.push_back(serial_tag_string | flag);
+			write_str(std::static_pointer_cast<Lisp_String>(o)->m_string);
+			break;
+		case lisp_type_symbol:
+			m_out.push_back(serial_tag_symbol | flag);
+			write_str(std::static_pointer_cast<Lisp_Symbol>(o)->m_string);
+			break;
+		case lisp_type_list:
+		{
+			auto lst = std::static_pointer_cast<Lisp_List>(o);
+			m_out.push_back(serial_tag_list | flag);
+			write_uint(lst->m_v.size());
+			for (auto &&e : lst->m_v) write(e);
+			break;
+		}
+		case lisp_type_env:
+		{
+			auto env = std::static_pointer_cast<Lisp_Env>(o);
+			if (env->m_sealed && m_handles) goto handle;
+			auto cnt = 0ull;
+			for (auto &&bucket : env->m_buckets) cnt += bucket.size();
+			m_out.push_back(serial_tag_env | flag);
+			write_uint(env->m_buckets.size());
+			m_out.push_back((env->m_fork ? 1 : 0) | (env->m_sealed ? 2 : 0));
+			if (env->m_parent) write(env->m_parent);
+			else m_out.push_back(serial_tag_none);
+			write_uint(cnt);
+			for (auto &&bucket : env->m_buckets)
+			{
+				for (auto &&p : bucket)
+				{
+					write(p.first);
+					write(p.second);
+				}
+			}
+			break;
+		}
+		case lisp_type_function:
+		{
+			auto f = std::static_pointer_cast<Lisp_Function>(o);
+			auto itr = std::find_if(begin(m_lisp->m_builtins), end(m_lisp->m_builtins), [&] (auto &e)
+			{
+				auto bf = std::static_pointer_cast<Lisp_Function>(e.second);
+				return bf->m_func == f->m_func && bf->m_ftype == f->m_ftype;
+			});
+			if (itr == end(m_lisp->m_builtins)) goto none;
+			m_out.push_back(serial_tag_function | flag);
+			write_str(itr->first->m_string);
+			break;
+		}
+		case lisp_type_error:
+		{
+			auto err = std::static_pointer_cast<Lisp_Error>(o);
+			m_out.push_back(serial_tag_error | flag);
+			write_str(err->m_msg);
+			write_str(err->m_file);
+			write_int(err->m_line_num);
+			write(err->m_obj);
+			break;
+		}
+		case lisp_type_mailbox:
+			//in process messages pass thread safe objects, and sealed envs
+			//that nobody writes to, by reference
+			if (m_handles == nullptr) goto none;
+		handle:
+			m_out.push_back(serial_tag_handle | flag);
+			write_uint(m_handles->size());
+			m_handles->push_back(o);
+			break;
+		default:
+		none:
+			//streams have no meaning outside this process, they come back as nil,
+			//the reader keeps no slot for them so the id is given back
+			if (shared)
+			{
+				m_ids.erase(o.get());
+				--m_next_id;
+			}
+			m_out.push_back(serial_tag_none);
+		}
+	}
+
+	const Lisp *m_lisp;
+	std::string &m_out;
+	std::vector<std::shared_ptr<Lisp_Obj>> *m_handles;
+	std::unordered_map<const Lisp_Obj*, unsigned long long> m_ids;
+	unsigned long long m_next_id = 0;
+	std::shared_ptr<Lisp_Obj> m_closure;
+	std::unordered_set<const Lisp_Obj*> m_bound;
+};
+
+struct Serial_Reader
+{
+	Serial_Reader(Lisp *lisp, const char *data, size_t len, const std::vector<std::shared_ptr<Lisp_Obj>> *handles = nullptr)
+		: m_lisp(lisp)
+		, m_pos(data)
+		, m_end(data + len)
+		, m_handles(handles)
+	{}
+
+	bool read_uint(unsigned long long &n)
+	{
+		n = 0;
+		for (auto shift = 0; m_pos != m_end && shift < 64; shift += 7)
+		{
+			auto c = (unsigned char)*m_pos++;
+			n |= (unsigned long long)(c & 0x7f) << shift;
+			if (!(c & 0x80)) return true;
+		}
+		return false;
+	}
+
+	bool read_int(long long &n)
+	{
+		unsigned long long u;
+		if (!read_uint(u)) return false;
+		n = (long long)(u >> 1) ^ -(long long)(u & 1);
+		return true;
+	}
+
+	bool read_str(std::string &s)
+	{
+		unsigned long long len;
+		if (!read_uint(len) || len > (unsigned long long)(m_end - m_pos)) return false;
+		s.assign(m_pos, len);
+		m_pos += len;
+		return true;
+	}
+
+	//returns nullptr on a malformed, truncated or too deeply nested buffer
+	std::shared_ptr<Lisp_Obj> read()
+	{
+		if (m_depth >= serial_max_depth) return nullptr;
+		++m_depth;
+		auto obj = read_obj();
+		--m_depth;
+		return obj;
+	}
+
+	std::shared_ptr<Lisp_Obj> read_obj()
+	{
+		if (m_pos == m_end) return nullptr;
+		auto tag = *m_pos++;
+		//flagged objects take the next id before anything inside them is read
+		auto id = m_objs.size();
+		if (tag & serial_flag_shared) m_objs.emplace_back();
+		else id = -1;
+		auto keep = [&] (std::shared_ptr<Lisp_Obj> o)
+		{
+			if (id != (size_t)-1) m_objs[id] = o;
+			return o;
+		};
+		switch (tag & ~serial_flag_shared)
+		{
+		case serial_tag_ref:
+		{
+			unsigned long long ref;
+			if (!read_uint(ref) || ref >= m_objs.size() || !m_objs[ref]) return nullptr;
+			return m_objs[ref];
+		}
+		case serial_tag_none:
+			return m_lisp->m_sym_nil;
+		case serial_tag_integer:
+		{
+			auto num = std::make_shared<Lisp_Integer>();
+			if (!read_int(num->m_value)) return nullptr;
+			return keep(num);
+		}
+		case serial_tag_string:
+		{
+			auto str = std::make_shared<Lisp_String>();
+			if (!read_str(str->m_string)) return nullptr;
+			return keep(str);
+		}
+		case serial_tag_symbol:
+		{
+			auto sym = std::make_shared<Lisp_Symbol>();
+			if (!read_str(sym->m_string)) return nullptr;
+			return keep(intern(sym));
+		}
+		case serial_tag_list:
+		{
+			auto lst = std::make_shared<Lisp_List>();
+			keep(lst);
+			unsigned long long len;
+			if (!read_uint(len) || len > (unsigned long long)(m_end - m_pos)) return nullptr;
+			lst->m_v.reserve(len);
+			while (len--)
+			{
+				auto o = read();
+				if (o == nullptr) return nullptr;
+				lst->m_v.push_back(std::move(o));
+			}
+			return lst;
+		}
+		case serial_tag_env:
+		{
+			unsigned long long num_buckets, cnt;
+			if (!read_uint(num_buckets) || !num_buckets || num_buckets > 1 << 24) return nullptr;
+			auto env = std::make_shared<Lisp_Env>(num_buckets);
+			keep(env);
+			if (m_pos == m_end) return nullptr;
+			auto flags = *m_pos++;
+			env->m_fork = (flags & 1) != 0;
+			auto parent = read();
+			if (parent == nullptr) return nullptr;
+			if (parent->type() == lisp_type_env) env->set_parent(std::static_pointer_cast<Lisp_Env>(parent));
+			if (!read_uint(cnt)) return nullptr;
+			while (cnt--)
+			{
+				auto sym = read();
+				if (sym == nullptr || sym->type() != lisp_type_symbol) return nullptr;
+				auto value = read();
+				if (value == nullptr) return nullptr;
+				env->insert(std::static_pointer_cast<Lisp_Symbol>(sym), value);
+			}
+			env->m_sealed = (flags & 2) != 0;
+			return env;
+		}
+		case serial_tag_function:
+		{
+			std::string name;
+			if (!read_str(name)) return nullptr;
+			auto itr = std::find_if(begin(m_lisp->m_builtins), end(m_lisp->m_builtins), [&] (auto &e)
+			{
+				return e.first->m_string == name;
+			});
+			if (itr == end(m_lisp->m_builtins)) return nullptr;
+			return keep(itr->second);
+		}
+		case serial_tag_error:
+		{
+			std::string msg, file;
+			long long line;
+			if (!read_str(msg) || !read_str(file) || !read_int(line)) return nullptr;
+			auto o = read();
+			if (o == nullptr) return nullptr;
+			return keep(std::make_shared<Lisp_Error>(msg, file, line, o));
+		}
+		case serial_tag_handle:
+		{
+			unsigned long long index;
+			if (m_handles == nullptr || !read_uint(index) || index >= m_handles->size()) return nullptr;
+			return keep((*m_handles)[index]);
+		}
+		default:
+			return nullptr;
+		}
+	}
+
+	Lisp *m_lisp;
+	const char *m_pos;
+	const char *m_end;
+	const std::vector<std::shared_ptr<Lisp_Obj>> *m_handles;
+	std::vector<std::shared_ptr<Lisp_Obj>> m_objs;
+	int m_depth = 0;
+};
+
+std::string Lisp::serial_write(const std::shared_ptr<Lisp_Obj> &obj) const
+{
+	std::string out;
+	Serial_Writer(this, out).write(obj);
+	return out;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::serial_read(const char *data, size_t len)
+{
+	return Serial_Reader(this, data, len).read();
+}
+
+Lisp_Message Lisp::mail_pack(const std::shared_ptr<Lisp_Obj> &obj, const std::shared_ptr<Lisp_Env> &closure) const
+{
+	//given an env_closure, the unsealed envs it was taken from are written
+	//as it wherever obj reaches them
+	Lisp_Message msg;
+	Serial_Writer w(this, msg.m_data, &msg.m_handles);
+	if (closure)
+	{
+		w.m_closure = closure;
+		for (auto env = m_env.get(); env && !env->m_sealed; env = env->m_parent.get()) w.m_bound.insert(env);
+	}
+	w.write(obj);
+	return msg;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::mail_unpack(const Lisp_Message &msg)
+{
+	auto obj = Serial_Reader(this, msg.m_data.data(), msg.m_data.size(), &msg.m_handles).read();
+	if (obj == nullptr) return m_sym_nil;
+	return obj;
+}
+
+bool Lisp::image_save(const std::string &path) const
+{
+	std::string out(image_magic, sizeof(image_magic));
+	Serial_Writer w(this, out);
+	w.write_uint(m_next_sym);
+	w.write(env_root());
+	std::ofstream f;
+	f.open(path, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+	if (!f.is_open()) return false;
+	f.write(out.data(), out.size());
+	return f.good();
+}
+
+bool Lisp::image_load(const std::string &path)
+{
+	auto ok = false;
+#ifdef _WIN64
+	std::ifstream f;
+	f.open(path, std::ifstream::in | std::ifstream::binary);
+	if (!f.is_open()) return false;
+	auto buf = std::string((std::istreambuf_iterator<char>(f)), (std::istreambuf_iterator<char>()));
+	auto data = buf.data();
+	auto len = buf.size();
+#else
+	auto fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) return false;
+	struct stat fs;
+	auto len = (size_t)0;
+	if (fstat(fd, &fs) == 0) len = fs.st_size;
+	auto data = len ? (const char*)mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0) : (const char*)MAP_FAILED;
+	close(fd);
+	if (data == (const char*)MAP_FAILED) return false;
+#endif
+	if (len > sizeof(image_magic)
+		&& std::equal(image_magic, image_magic + sizeof(image_magic), data))
+	{
+		Serial_Reader r(this, data + sizeof(image_magic), len - sizeof(image_magic));
+		unsigned long long next_sym;
+		if (r.read_uint(next_sym))
+		{
+			auto root = r.read();
+			if (root != nullptr && root->type() == lisp_type_env)
+			{
+				m_env = std::static_pointer_cast<Lisp_Env>(root);
+				m_next_sym = next_sym;
+				ok = true;
+			}
+		}
+	}
+#ifndef _WIN64
+	munmap((void*)data, len);
+#endif
+	return ok;
+}
+
+std::string cache_path(const std::string &dir, const std::string &path)
+{
+	std::ostringstream ss;
+	ss << dir << '/' << std::hex << std::hash<std::string>{}(path) << ".fasl";
+	return ss.str();
+}
+
+static unsigned long long source_hash(const std::string &s)
+{
+	//fnv-1a, mixed with the length
+	auto h = 14695981039346656037ull ^ s.size();
+	for (auto c : s) h = (h ^ (unsigned char)c) * 1099511628211ull;
+	return h;
+}
+
+std::shared_ptr<Lisp_List> Lisp::cache_load(const std::string &path, unsigned long long &hash)
+{
+	//valid only if the source path and a hash of its content still match,
+	//mtimes can't tell apart two writes of the same size in one clock tick,
+	//the hash is handed back for cache_save to key what gets parsed
+	std::string src;
+	hash = 0;
+	if (!file_load(path.c_str(), src)) return nullptr;
+	hash = source_hash(src);
+	std::ifstream f;
+	f.open(cache_path(m_cache_dir, path), std::ifstream::in | std::ifstream::binary);
+	if (!f.is_open()) return nullptr;
+	auto buf = std::string((std::istreambuf_iterator<char>(f)), (std::istreambuf_iterator<char>()));
+	if (buf.size() <= sizeof(cache_magic)
+		|| !std::equal(cache_magic, cache_magic + sizeof(cache_magic), buf.data())) return nullptr;
+	Serial_Reader r(this, buf.data() + sizeof(cache_magic), buf.size() - sizeof(cache_magic));
+	unsigned long long key;
+	if (!r.read_str(src) || !r.read_uint(key)) return nullptr;
+	if (src != path || key != hash) return nullptr;
+	auto forms = r.read();
+	if (forms == nullptr || forms->type() != lisp_type_list) return nullptr;
+	return std::static_pointer_cast<Lisp_List>(forms);
+}
+
+void Lisp::cache_save(const std::string &path, unsigned long long hash, const std::shared_ptr<Lisp_List> &forms) const
+{
+	std::string out(cache_magic, sizeof(cache_magic));
+	Serial_Writer w(this, out);
+	w.write_str(path);
+	w.write_uint(hash);
+	w.write(forms);
+	//write to a temp file and rename over the entry, readers never see a partial file
+	auto name = cache_path(m_cache_dir, path);
+	auto tmp = name + ".tmp" + std::to_string(getpid());
+	std::ofstream f;
+	f.open(tmp, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+	if (!f.is_open())
+	{
+		rmkdir(tmp.c_str());
+		f.open(tmp, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+		if (!f.is_open()) return;
+	}
+	f.write(out.data(), out.size());
+	f.close();
+	if (!f.good() || std::rename(tmp.c_str(), name.c_str()) != 0) std::remove(tmp.c_str());
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::serialize(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1)
+	{
+		return std::make_shared<Lisp_String>(serial_write(args->m_v[0]));
+	}
+	return repl_error("(serialize obj)", error_msg_wrong_num_of_args, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::deserialize(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->type() == lisp_type_string)
+	{
+		//decodes straight out of the string's buffer
+		auto &data = std::static_pointer_cast<Lisp_String>(args->m_v[0])->m_string;
+		auto obj = serial_read(data.data(), data.size());
+		if (obj) return obj;
+		return repl_error("(deserialize str)", error_msg_bad_message, args);
+	}
+	return repl_error("(deserialize str)", error_msg_wrong_types, args);
+}
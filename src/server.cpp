@@ -0,0 +1,270 @@
+/*
+    ChrysaLisp++
+    Copyright (C) 2018 Chris Hinsley
+	chris (dot) hinsley (at) gmail (dot) com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lisp.h"
+#include <deque>
+#include <thread>
+#ifndef _WIN64
+	#include <signal.h>
+	#include <unistd.h>
+	#include <dirent.h>
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+#endif
+
+#ifdef _WIN64
+int lisp_daemon(Lisp &lisp, const std::string &path, int max_children)
+{
+	std::cout << "Daemon mode not supported on this platform" << std::endl;
+	return 1;
+}
+
+int lisp_workers(Lisp &lisp, std::deque<std::string> &jobs, int num_workers)
+{
+	std::cout << "Worker mode not supported on this platform" << std::endl;
+	return 1;
+}
+#else
+void ostream_flush_all();
+
+void daemon_run(Lisp &lisp, const std::string &request)
+{
+	//a request is either lisp source or the path of a file to run
+	auto args = std::make_shared<Lisp_List>();
+	auto start = request.find_first_not_of(" \t\r\n");
+	auto res = std::static_pointer_cast<Lisp_Obj>(lisp.m_sym_nil);
+	if (start == std::string::npos) return;
+	if (request[start] == '(' || request[start] == ';')
+	{
+		std::istringstream ss(request);
+		args->m_v.push_back(std::make_shared<Lisp_Sys_Stream>(ss));
+		args->m_v.push_back(std::make_shared<Lisp_String>("daemon"));
+		res = lisp.repl(args);
+	}
+	else
+	{
+		auto file = request.substr(start, request.find_last_not_of(" \t\r\n") + 1 - start);
+		auto stream = std::make_shared<Lisp_File_IStream>(file);
+		if (!stream->is_open())
+		{
+			std::cout << "No such file: " << file << std::endl;
+			return;
+		}
+		args->m_v.push_back(stream);
+		args->m_v.push_back(std::make_shared<Lisp_String>(file));
+		res = lisp.repl(args);
+	}
+	res->print(std::cout);
+	std::cout << std::endl;
+}
+
+int lisp_daemon(Lisp &lisp, const std::string &path, int max_children)
+{
+	struct sockaddr_un addr = {};
+	if (path.size() >= sizeof(addr.sun_path))
+	{
+		std::cout << "Socket path too long: " << path << std::endl;
+		return 1;
+	}
+	addr.sun_family = AF_UNIX;
+	std::copy(begin(path), end(path), addr.sun_path);
+	auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path.c_str());
+	if (fd == -1
+		|| bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+		|| listen(fd, 64) == -1)
+	{
+		std::cout << "Can't listen on socket: " << path << std::endl;
+		return 1;
+	}
+	//children are reaped as they finish, the listen fd is polled with a
+	//timeout so an idle daemon still reaps them, at the limit no more
+	//connections are taken until one does, the rest wait in the backlog
+	const int daemon_reap_msecs = 250;
+	std::cout << std::flush;
+	auto children = 0;
+	for (;;)
+	{
+		while (children > 0 && waitpid(-1, nullptr, WNOHANG) > 0) --children;
+		while (children >= std::max(max_children, 1) && waitpid(-1, nullptr, 0) > 0) --children;
+		struct pollfd fds = {fd, POLLIN, 0};
+		if (poll(&fds, 1, children ? daemon_reap_msecs : -1) <= 0) continue;
+		auto conn = accept(fd, nullptr, nullptr);
+		if (conn == -1) continue;
+		ostream_flush_all();
+		auto pid = fork();
+		if (pid == 0)
+		{
+			//the child owns a copy on write snapshot of the booted process
+			close(fd);
+			std::string request;
+			char buf[4096];
+			for (;;)
+			{
+				auto len = ::read(conn, buf, sizeof(buf));
+				if (len <= 0) break;
+				request.append(buf, len);
+			}
+			dup2(conn, 1);
+			dup2(conn, 2);
+			close(conn);
+			daemon_run(lisp, request);
+			std::cout << std::flush;
+			ostream_flush_all();
+			_exit(0);
+		}
+		if (pid != -1) ++children;
+		close(conn);
+	}
+}
+
+struct Job_Result
+{
+	int m_index;
+	int m_status;
+	long long m_usecs;
+};
+
+void queue_expand(std::deque<std::string> &jobs)
+{
+	//a directory in the job list queues every file inside it
+	std::deque<std::string> out;
+	for (auto &&job : jobs)
+	{
+		struct stat fs;
+		if (stat(job.c_str(), &fs) != 0 || !S_ISDIR(fs.st_mode))
+		{
+			out.push_back(job);
+			continue;
+		}
+		std::vector<std::string> files;
+		auto dir = opendir(job.c_str());
+		if (dir == nullptr) continue;
+		while (auto entry = readdir(dir))
+		{
+			auto file = job + "/" + entry->d_name;
+			if (stat(file.c_str(), &fs) == 0 && S_ISREG(fs.st_mode)) files.push_back(file);
+		}
+		closedir(dir);
+		std::sort(begin(files), end(files));
+		out.insert(end(out), begin(files), end(files));
+	}
+	jobs.swap(out);
+}
+
+int lisp_workers(Lisp &lisp, std::deque<std::string> &jobs, int num_workers)
+{
+	queue_expand(jobs);
+	int job_pipe[2], res_pipe[2];
+	if (pipe(job_pipe) == -1 || pipe(res_pipe) == -1)
+	{
+		std::cout << "Can't create worker pipes" << std::endl;
+		return 1;
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+	//children inherit buffers, so empty them first, each child flushes its own
+	std::cout << std::flush;
+	ostream_flush_all();
+	std::vector<pid_t> pids;
+	for (auto i = 0; i < num_workers; ++i)
+	{
+		auto pid = fork();
+		if (pid == -1) break;
+		if (pid == 0)
+		{
+			//workers share the booted heap copy on write, and pull job indexes
+			//off the pipe, records are below PIPE_BUF so reads are atomic
+			close(job_pipe[1]);
+			close(res_pipe[0]);
+			int index;
+			while (::read(job_pipe[0], &index, sizeof(index)) == sizeof(index))
+			{
+				//each job gets a fresh fork of the root so jobs can't see each other
+				auto job_start = std::chrono::high_resolution_clock::now();
+				auto old_env = lisp.m_env;
+				lisp.m_env = lisp.env_overlay(lisp.env_root());
+				auto stream = std::make_shared<Lisp_File_IStream>(jobs[index]);
+				auto res = Job_Result{index, 1, 0};
+				if (!stream->is_open()) std::cout << "No such file: " << jobs[index] << std::endl;
+				else
+				{
+					auto args = std::make_shared<Lisp_List>();
+					args->m_v.push_back(stream);
+					args->m_v.push_back(std::make_shared<Lisp_String>(jobs[index]));
+					auto value = lisp.repl(args);
+					if (value == lisp.m_sym_nil) res.m_status = 0;
+					else
+					{
+						value->print(std::cout);
+						std::cout << "\n";
+					}
+				}
+				lisp.m_env = old_env;
+				std::cout << std::flush;
+				res.m_usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::high_resolution_clock::now() - job_start).count();
+				if (::write(res_pipe[1], &res, sizeof(res)) != sizeof(res)) break;
+			}
+			ostream_flush_all();
+			_exit(0);
+		}
+		pids.push_back(pid);
+	}
+	close(job_pipe[0]);
+	close(res_pipe[1]);
+	signal(SIGPIPE, SIG_IGN);
+	//jobs are fed from another thread, workers blocked on a full result
+	//pipe would otherwise leave us blocked on a full job pipe
+	std::thread feeder([&] ()
+	{
+		for (auto i = 0; i < (int)jobs.size(); ++i)
+		{
+			if (::write(job_pipe[1], &i, sizeof(i)) != sizeof(i)) break;
+		}
+		close(job_pipe[1]);
+	});
+
+	//collect results until every worker has closed its end
+	std::vector<Job_Result> results;
+	Job_Result res;
+	while (::read(res_pipe[0], &res, sizeof(res)) == sizeof(res)) results.push_back(res);
+	close(res_pipe[0]);
+	feeder.join();
+	for (auto pid : pids) waitpid(pid, nullptr, 0);
+	auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::high_resolution_clock::now() - start).count();
+
+	std::sort(begin(results), end(results), [] (auto &a, auto &b) { return a.m_index < b.m_index; });
+	auto failed = (int)(jobs.size() - results.size());
+	auto busy = 0ll;
+	std::cout << "\n";
+	for (auto &&r : results)
+	{
+		if (r.m_status) failed++;
+		busy += r.m_usecs;
+		std::cout << (r.m_status ? "fail " : "ok   ") << r.m_usecs / 1000.0 << "ms " << jobs[r.m_index] << "\n";
+	}
+	std::cout << results.size() << " jobs, " << failed << " failed, " << pids.size() << " workers, "
+		<< usecs / 1000.0 << "ms wall, " << busy / 1000.0 << "ms busy" << std::endl;
+	return failed ? 1 : 0;
+}
+#endif
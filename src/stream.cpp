@@ -19,8 +19,12 @@
 */
 
 #include "lisp.h"
+#ifndef _WIN64
+	#include <poll.h>
+#endif
 
 void rmkdir(const char *path);
+bool file_load(const char *path, std::string &s);
 
 std::shared_ptr<Lisp_Obj> Lisp::filestream(const std::shared_ptr<Lisp_List> &args)
 {
@@ -46,12 +50,31 @@ std::shared_ptr<Lisp_Obj> Lisp::filestream(const std::shared_ptr<Lisp_List> &arg
 
 std::shared_ptr<Lisp_Obj> Lisp::strstream(const std::shared_ptr<Lisp_List> &args)
 {
+	//no string makes a stream to write to, a string one to read it
+	if (!args->length()) return std::make_shared<Lisp_String_Stream>("");
 	if (args->length() == 1
 		&& args->m_v[0]->is_type(lisp_type_string))
 	{
-		return std::make_shared<Lisp_String_Stream>("");
+		return std::make_shared<Lisp_String_IStream>(std::static_pointer_cast<Lisp_String>(args->m_v[0]));
 	}
-	return repl_error("(string-stream str)", error_msg_wrong_types, args);
+	return repl_error("(string-stream [str])", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::iostream(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1)
+	{
+		//pipes, fifos and the like, reads never block, poll for input
+		std::shared_ptr<Lisp_File_IStream> s;
+		if (args->m_v[0]->is_type(lisp_type_integer))
+			s = std::make_shared<Lisp_File_IStream>((int)std::static_pointer_cast<Lisp_Integer>(args->m_v[0])->m_value);
+		else if (args->m_v[0]->is_type(lisp_type_string))
+			s = std::make_shared<Lisp_File_IStream>(std::static_pointer_cast<Lisp_String>(args->m_v[0])->m_string, true);
+		else return repl_error("(io-stream fd|path)", error_msg_wrong_types, args);
+		if (s->is_open()) return s;
+		return m_sym_nil;
+	}
+	return repl_error("(io-stream fd|path)", error_msg_wrong_num_of_args, args);
 }
 
 std::shared_ptr<Lisp_Obj> Lisp::read(const std::shared_ptr<Lisp_List> &args)
@@ -60,8 +83,19 @@ std::shared_ptr<Lisp_Obj> Lisp::read(const std::shared_ptr<Lisp_List> &args)
 		&& args->m_v[0]->is_type(lisp_type_istream)
 		&& args->m_v[1]->is_type(lisp_type_integer))
 	{
+		//a form cut short by a nonblocking stream is left buffered, nil
+		auto &in = *std::static_pointer_cast<Lisp_IStream>(args->m_v[0]);
+		if (auto err = co_wait(in)) return err;
+		in.mark();
+		auto form = repl_read(in);
+		if (in.m_waiting)
+		{
+			in.rewind();
+			return m_sym_nil;
+		}
+		in.unmark();
 		auto value = std::make_shared<Lisp_List>();
-		value->m_v.push_back(repl_read(std::static_pointer_cast<Lisp_IStream>(args->m_v[0])->get_stream()));
+		value->m_v.push_back(form);
 		value->m_v.push_back(std::make_shared<Lisp_Integer>(' '));
 		return value;
 	}
@@ -83,6 +117,7 @@ std::shared_ptr<Lisp_Obj> Lisp::readchar(const std::shared_ptr<Lisp_List> &args)
 				width = std::static_pointer_cast<Lisp_Integer>(args->m_v[1])->m_value;
 				width = ((width - 1) & 7) + 1;
 			}
+			if (auto err = co_wait(*std::static_pointer_cast<Lisp_IStream>(args->m_v[0]))) return err;
 			auto value = std::make_shared<Lisp_Integer>(0);
 			auto chars = (char*) &value->m_value;
 			do
@@ -98,19 +133,146 @@ std::shared_ptr<Lisp_Obj> Lisp::readchar(const std::shared_ptr<Lisp_List> &args)
 	return repl_error("(read-char stream [width])", error_msg_wrong_num_of_args, args);
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::readpacked(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if ((len == 3 || len == 4)
+		&& args->m_v[0]->is_type(lisp_type_istream)
+		&& args->m_v[1]->is_type(lisp_type_integer)
+		&& args->m_v[2]->is_type(lisp_type_integer)
+		&& (len == 3 || args->m_v[3]->is_type(lisp_type_symbol)))
+	{
+		//bulk copies out of the stream a chunk at a time, so the buffer never
+		//outgrows the input, then unpacked, unsigned like read-char, the bytes
+		//of a last element cut short are left in the stream
+		auto &in = *std::static_pointer_cast<Lisp_IStream>(args->m_v[0]);
+		auto width = std::static_pointer_cast<Lisp_Integer>(args->m_v[1])->m_value;
+		width = ((width - 1) & 7) + 1;
+		auto count = std::static_pointer_cast<Lisp_Integer>(args->m_v[2])->m_value;
+		if (count <= 0) return repl_error("(read-packed stream width count [:big])", error_msg_not_valid_index, args);
+		auto big = len == 4 && std::static_pointer_cast<Lisp_Symbol>(args->m_v[3])->m_string == ":big";
+		if (auto err = co_wait(in)) return err;
+		const long long packed_chunk = 64 * 1024;
+		std::string data;
+		auto value = std::make_shared<Lisp_List>();
+		while (count)
+		{
+			auto want = std::min(count, packed_chunk / width);
+			data.resize(want * width);
+			auto bytes = (long long)in.read_chars(&data[0], data.size());
+			auto got = bytes / width;
+			if (bytes % width) in.unread(&data[got * width], bytes % width);
+			auto p = (const unsigned char*)data.data();
+			for (auto i = 0ll; i < got; ++i, p += width)
+			{
+				auto n = 0ull;
+				if (big) for (auto b = 0; b < width; ++b) n = (n << 8) | p[b];
+				else for (auto b = width - 1; b >= 0; --b) n = (n << 8) | p[b];
+				value->m_v.push_back(std::make_shared<Lisp_Integer>((long long)n));
+			}
+			if (got < want) break;
+			count -= got;
+		}
+		if (value->m_v.empty()) return m_sym_nil;
+		return value;
+	}
+	return repl_error("(read-packed stream width count [:big])", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::readavail(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_istream))
+	{
+		return std::make_shared<Lisp_Integer>(std::static_pointer_cast<Lisp_IStream>(args->m_v[0])->avail());
+	}
+	return repl_error("(read-avail stream)", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::poll(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if ((len == 1 || len == 2)
+		&& args->m_v[0]->is_type(lisp_type_list)
+		&& (len == 1 || args->m_v[1]->is_type(lisp_type_integer)))
+	{
+		auto lst = std::static_pointer_cast<Lisp_List>(args->m_v[0]);
+		if (!std::all_of(begin(lst->m_v), end(lst->m_v), [] (auto &&o) { return o->is_type(lisp_type_istream); }))
+			return repl_error("(poll streams [timeout])", error_msg_not_a_stream, args);
+		auto timeout = len == 2 ? (int)std::static_pointer_cast<Lisp_Integer>(args->m_v[1])->m_value : -1;
+		//streams with input buffered, or nothing to wait on, are ready now,
+		//unless the last read ran out mid line or form, then they wait for more
+		auto value = std::make_shared<Lisp_List>();
+		for (auto i = 0; i < (int)lst->m_v.size(); ++i)
+		{
+			auto &in = *std::static_pointer_cast<Lisp_IStream>(lst->m_v[i]);
+			if (in.poll_fd() == -1 || (!in.m_waiting && (in.m_pos != in.m_end || in.ready())))
+				value->m_v.push_back(std::make_shared<Lisp_Integer>(i));
+		}
+#ifndef _WIN64
+		if (value->m_v.empty() && !lst->m_v.empty())
+		{
+			//index of the stream is the index of its descriptor
+			std::vector<struct pollfd> fds;
+			fds.reserve(lst->m_v.size());
+			for (auto &&o : lst->m_v)
+				fds.push_back({std::static_pointer_cast<Lisp_IStream>(o)->poll_fd(), POLLIN, 0});
+			if (::poll(fds.data(), fds.size(), timeout) > 0)
+			{
+				for (auto i = 0; i < (int)fds.size(); ++i)
+				{
+					if (fds[i].revents) value->m_v.push_back(std::make_shared<Lisp_Integer>(i));
+				}
+			}
+		}
+#endif
+		if (value->m_v.empty()) return m_sym_nil;
+		return value;
+	}
+	return repl_error("(poll streams [timeout])", error_msg_wrong_types, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::readline(const std::shared_ptr<Lisp_List> &args)
 {
 	if (args->length() == 1
 		&& args->m_v[0]->is_type(lisp_type_istream))
 	{
-		bool state;
-		auto s = std::static_pointer_cast<Lisp_IStream>(args->m_v[0])->read_line(state);
-		if (state) return std::make_shared<Lisp_String>(s);
+		auto &in = *std::static_pointer_cast<Lisp_IStream>(args->m_v[0]);
+		if (auto err = co_wait(in)) return err;
+		auto value = std::make_shared<Lisp_String>();
+		if (in.read_line(value->m_string)) return value;
 		return m_sym_nil;
 	}
 	return repl_error("(read-line stream)", error_msg_wrong_types, args);
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::eachline(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 2
+		&& args->m_v[1]->is_type(lisp_type_istream))
+	{
+		//while the lambda doesn't hang on to the line string it's refilled
+		//in place, so lines cost no allocations once the capacity is there
+		auto &in = *std::static_pointer_cast<Lisp_IStream>(args->m_v[1]);
+		auto line = std::make_shared<Lisp_String>();
+		auto params = std::make_shared<Lisp_List>();
+		for (;;)
+		{
+			if (line.use_count() > 1) line = std::make_shared<Lisp_String>();
+			if (params.use_count() > 1) params = std::make_shared<Lisp_List>();
+			if (auto err = co_wait(in)) return err;
+			if (!in.read_line(line->m_string)) break;
+			params->m_v.clear();
+			params->m_v.push_back(line);
+			auto value = repl_apply(args->m_v[0], params);
+			if (value->type() == lisp_type_error) return value;
+			params->m_v.clear();
+		}
+		return m_sym_nil;
+	}
+	return repl_error("(each-line lambda stream)", error_msg_wrong_types, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::write(const std::shared_ptr<Lisp_List> &args)
 {
 	if (args->length() == 2
@@ -120,11 +282,47 @@ std::shared_ptr<Lisp_Obj> Lisp::write(const std::shared_ptr<Lisp_List> &args)
 		auto stream = std::static_pointer_cast<Lisp_OStream>(args->m_v[0]);
 		auto value = std::static_pointer_cast<Lisp_String>(args->m_v[1]);
 		stream->write_line(value->m_string);
+		if (stream->m_error) return repl_error("(write stream str)", error_msg_write_error, args);
 		return stream;
 	}
 	return repl_error("(write stream str)", error_msg_wrong_types, args);
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::writeline(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 2
+		&& args->m_v[0]->is_type(lisp_type_ostream)
+		&& args->m_v[1]->is_type(lisp_type_string))
+	{
+		auto stream = std::static_pointer_cast<Lisp_OStream>(args->m_v[0]);
+		auto value = std::static_pointer_cast<Lisp_String>(args->m_v[1]);
+		stream->write_chars(value->m_string.data(), value->m_string.size());
+		stream->write_char('\n');
+		if (stream->m_error) return repl_error("(write-line stream str)", error_msg_write_error, args);
+		return stream;
+	}
+	return repl_error("(write-line stream str)", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::writeall(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 2
+		&& args->m_v[0]->is_type(lisp_type_ostream)
+		&& args->m_v[1]->is_type(lisp_type_list))
+	{
+		auto stream = std::static_pointer_cast<Lisp_OStream>(args->m_v[0]);
+		auto lst = std::static_pointer_cast<Lisp_List>(args->m_v[1]);
+		if (std::all_of(begin(lst->m_v), end(lst->m_v), [] (auto &&o) { return o->is_type(lisp_type_string); }))
+		{
+			stream->write_all(lst);
+			if (stream->m_error) return repl_error("(write-all stream strs)", error_msg_write_error, args);
+			return stream;
+		}
+		return repl_error("(write-all stream strs)", error_msg_not_all_strings, args);
+	}
+	return repl_error("(write-all stream strs)", error_msg_wrong_types, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::writechar(const std::shared_ptr<Lisp_List> &args)
 {
 	auto len = args->length();
@@ -132,6 +330,7 @@ std::shared_ptr<Lisp_Obj> Lisp::writechar(const std::shared_ptr<Lisp_List> &args
 	{
 		if (args->m_v[0]->is_type(lisp_type_ostream))
 		{
+			auto stream = std::static_pointer_cast<Lisp_OStream>(args->m_v[0]);
 			auto width = 1ll;
 			if (len == 3)
 			{
@@ -143,33 +342,30 @@ std::shared_ptr<Lisp_Obj> Lisp::writechar(const std::shared_ptr<Lisp_List> &args
 
 			if (args->m_v[1]->is_type(lisp_type_list))
 			{
+				//the low bytes of each integer are packed and written in one go
 				auto list = std::static_pointer_cast<Lisp_List>(args->m_v[1]);
 				if (!list->m_v.empty())
 				{
+					std::string chars;
+					chars.reserve(list->m_v.size() * width);
 					for (auto &&value : list->m_v)
 					{
 						if (!value->is_type(lisp_type_integer))
 							return repl_error("(write-char stream list|num [width])", error_msg_not_a_number, args);
-						auto chars = (char*) &(std::static_pointer_cast<Lisp_Integer>(value))->m_value;
-						auto w = width;
-						do
-						{
-							std::static_pointer_cast<Lisp_OStream>(args->m_v[0])->write_char(*(chars++));
-						} while (--w);
+						chars.append((char*) &(std::static_pointer_cast<Lisp_Integer>(value))->m_value, width);
 					}
-					return args->m_v[0];
+					stream->write_chars(chars.data(), chars.size());
+					if (stream->m_error) return repl_error("(write-char stream list|num [width])", error_msg_write_error, args);
+					return stream;
 				}
 				return repl_error("(write-char stream list|num [width])", error_msg_wrong_num_of_args, args);
 			}
 			else if (args->m_v[1]->is_type(lisp_type_integer))
 			{
 				auto value = std::static_pointer_cast<Lisp_Integer>(args->m_v[1]);
-				auto chars = (char*) &value->m_value;
-				do
-				{
-					std::static_pointer_cast<Lisp_OStream>(args->m_v[0])->write_char(*(chars++));
-				} while (--width);
-				return args->m_v[0];
+				stream->write_chars((char*) &value->m_value, width);
+				if (stream->m_error) return repl_error("(write-char stream list|num [width])", error_msg_write_error, args);
+				return stream;
 			}
 			return repl_error("(write-char stream list|num [width])", error_msg_not_a_number, args);
 		}
@@ -178,25 +374,87 @@ std::shared_ptr<Lisp_Obj> Lisp::writechar(const std::shared_ptr<Lisp_List> &args
 	return repl_error("(write-char stream list|num [width])", error_msg_wrong_num_of_args, args);
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::writepacked(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if ((len == 3 || len == 4)
+		&& args->m_v[0]->is_type(lisp_type_ostream)
+		&& args->m_v[1]->is_type(lisp_type_integer)
+		&& (args->m_v[2]->is_type(lisp_type_list) || args->m_v[2]->is_type(lisp_type_integer))
+		&& (len == 3 || args->m_v[3]->is_type(lisp_type_symbol)))
+	{
+		//packed into one buffer, then handed to the stream in one write
+		auto width = std::static_pointer_cast<Lisp_Integer>(args->m_v[1])->m_value;
+		width = ((width - 1) & 7) + 1;
+		auto big = len == 4 && std::static_pointer_cast<Lisp_Symbol>(args->m_v[3])->m_string == ":big";
+		auto nums = std::make_shared<Lisp_List>();
+		if (args->m_v[2]->is_type(lisp_type_list)) nums = std::static_pointer_cast<Lisp_List>(args->m_v[2]);
+		else nums->m_v.push_back(args->m_v[2]);
+		std::string data(nums->m_v.size() * width, 0);
+		auto p = (unsigned char*)&data[0];
+		for (auto &&o : nums->m_v)
+		{
+			if (!o->is_type(lisp_type_integer))
+				return repl_error("(write-packed stream width list|num [:big])", error_msg_not_all_nums, args);
+			auto n = (unsigned long long)std::static_pointer_cast<Lisp_Integer>(o)->m_value;
+			if (big) for (auto b = width - 1; b >= 0; --b, n >>= 8) p[b] = (unsigned char)n;
+			else for (auto b = 0; b < width; ++b, n >>= 8) p[b] = (unsigned char)n;
+			p += width;
+		}
+		auto stream = std::static_pointer_cast<Lisp_OStream>(args->m_v[0]);
+		stream->write_chars(data.data(), data.size());
+		if (stream->m_error) return repl_error("(write-packed stream width list|num [:big])", error_msg_write_error, args);
+		return stream;
+	}
+	return repl_error("(write-packed stream width list|num [:big])", error_msg_wrong_types, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::prin(const std::shared_ptr<Lisp_List> &args)
 {
 	auto value = std::static_pointer_cast<Lisp_Obj>(m_sym_nil);
+	std::string s;
 	for (auto &obj : args->m_v)
 	{
 		value = obj;
-		if (value->type() == lisp_type_string) std::cout << std::static_pointer_cast<Lisp_String>(value)->m_string;
-		else value->print(std::cout);
+		if (value->type() == lisp_type_string) s.append(std::static_pointer_cast<Lisp_String>(value)->m_string);
+		else value->print_to(s);
 	}
+	std::cout.write(s.data(), s.size());
 	return value;
 }
 
 std::shared_ptr<Lisp_Obj> Lisp::print(const std::shared_ptr<Lisp_List> &args)
 {
+	//stdout is only flushed when its buffer fills, every -l lines, on
+	//(flush) or before stdin is read
 	auto value = prin(args);
-	std::cout << std::endl;
+	std::cout << '\n';
+	if (m_flush_lines > 0 && ++m_print_lines >= m_flush_lines)
+	{
+		m_print_lines = 0;
+		std::cout.flush();
+	}
 	return value;
 }
 
+std::shared_ptr<Lisp_Obj> Lisp::flush(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 0)
+	{
+		std::cout.flush();
+		return m_sym_nil;
+	}
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_ostream))
+	{
+		auto stream = std::static_pointer_cast<Lisp_OStream>(args->m_v[0]);
+		stream->flush();
+		if (stream->m_error) return repl_error("(flush [stream])", error_msg_write_error, args);
+		return stream;
+	}
+	return repl_error("(flush [stream])", error_msg_wrong_types, args);
+}
+
 std::shared_ptr<Lisp_Obj> Lisp::save(const std::shared_ptr<Lisp_List> &args)
 {
 	if (args->length() == 2
@@ -227,14 +485,8 @@ std::shared_ptr<Lisp_Obj> Lisp::load(const std::shared_ptr<Lisp_List> &args)
 	if (args->length() == 1
 		&& args->m_v[0]->is_type(lisp_type_string))
 	{
-		std::ifstream f;
-		f.open(std::static_pointer_cast<Lisp_String>(args->m_v[0])->m_string,
-			std::ifstream::in | std::ifstream::binary);
-		if (f.is_open())
-		{
-			return std::make_shared<Lisp_String>(std::string((std::istreambuf_iterator<char>(f)),
-												(std::istreambuf_iterator<char>())));
-		}
+		auto value = std::make_shared<Lisp_String>();
+		if (file_load(std::static_pointer_cast<Lisp_String>(args->m_v[0])->m_string.c_str(), value->m_string)) return value;
 		return m_sym_nil;
 	}
 	return repl_error("(load path)", error_msg_wrong_types, args);
@@ -0,0 +1,959 @@
+/*
+    ChrysaLisp++
+    Copyright (C) 2018 Chris Hinsley
+	chris (dot) hinsley (at) gmail (dot) com
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lisp.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <thread>
+#ifndef _WIN64
+	#include <unistd.h>
+#endif
+
+bool file_load(const char *path, std::string &s);
+
+//////////
+//Lisp_Pool
+//////////
+
+//worker threads, each owning its own Lisp instance, objects only cross
+//between instances as serialized messages
+class Lisp_Pool
+{
+public:
+	Lisp_Pool(int num_workers);
+	~Lisp_Pool();
+	void run(const std::function<void(Lisp &lisp)> &work, const std::function<void()> &local);
+	size_t size() const { return m_threads.size(); }
+	int m_pid;
+private:
+	void worker();
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+	const std::function<void(Lisp &lisp)> *m_work = nullptr;
+	unsigned long long m_generation = 0;
+	size_t m_finished = 0;
+	bool m_quit = false;
+};
+
+Lisp_Pool::Lisp_Pool(int num_workers)
+#ifdef _WIN64
+	: m_pid(0)
+#else
+	: m_pid(getpid())
+#endif
+{
+	for (auto i = 0; i < num_workers; ++i) m_threads.emplace_back(&Lisp_Pool::worker, this);
+}
+
+Lisp_Pool::~Lisp_Pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_start.notify_all();
+	for (auto &&t : m_threads) t.join();
+}
+
+void Lisp_Pool::worker()
+{
+	Lisp lisp;
+	//nested parallel calls from a worker just run on the worker
+	lisp.m_pool_size = 0;
+	auto root = lisp.m_env;
+	auto generation = 0ull;
+	for (;;)
+	{
+		const std::function<void(Lisp &lisp)> *work;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start.wait(lock, [&] { return m_quit || m_generation != generation; });
+			if (m_quit) return;
+			generation = m_generation;
+			work = m_work;
+		}
+		(*work)(lisp);
+		lisp.m_env = root;
+		lisp.m_budget = Lisp_Budget();
+		lisp.m_tick = LLONG_MAX;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_finished;
+		}
+		m_done.notify_one();
+	}
+}
+
+void Lisp_Pool::run(const std::function<void(Lisp &lisp)> &work, const std::function<void()> &local)
+{
+	//the calling thread takes part, then waits for the workers to drain
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_work = &work;
+		m_finished = 0;
+		++m_generation;
+	}
+	m_start.notify_all();
+	local();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [&] { return m_finished == m_threads.size(); });
+}
+
+std::shared_ptr<Lisp_Pool> Lisp::pool()
+{
+	//a pool inherited across fork() has no threads behind it
+#ifdef _WIN64
+	auto pid = 0;
+#else
+	auto pid = getpid();
+#endif
+	if (m_pool_size <= 1) return nullptr;
+	if (!m_pool || m_pool->m_pid != pid || m_pool->size() != (size_t)(m_pool_size - 1))
+	{
+		m_pool.reset();
+		m_pool = std::make_shared<Lisp_Pool>(m_pool_size - 1);
+	}
+	return m_pool;
+}
+
+std::vector<std::shared_ptr<Lisp_Obj>> Lisp::par_apply(const char *usage, long long start, long long end,
+	const std::shared_ptr<Lisp_Obj> &func, const std::shared_ptr<Lisp_List> &seqs)
+{
+	//results come back in iteration order, evaluation stops early at the
+	//first error, and only errors before it in order are kept
+	auto dir = 1;
+	if (start > end)
+	{
+		dir = -1;
+		--start;
+		--end;
+	}
+	auto count = (end - start) * dir;
+	std::vector<std::shared_ptr<Lisp_Obj>> results(count);
+	std::vector<Lisp_Message> remote(count);
+	std::atomic<long long> next(0);
+	std::atomic<long long> error(count);
+
+	auto apply_loop = [&] (Lisp &lisp, const std::shared_ptr<Lisp_Obj> &f,
+		const std::shared_ptr<Lisp_List> &s, bool local)
+	{
+		lisp.env_push();
+		for (;;)
+		{
+			auto k = next++;
+			if (k >= count || k > error) break;
+			auto index = start + k * dir;
+			auto params = std::make_shared<Lisp_List>();
+			lisp.m_env->insert(lisp.m_sym_underscore, std::make_shared<Lisp_Integer>(index));
+			for (auto &&o : s->m_v) params->m_v.push_back(std::static_pointer_cast<Lisp_Seq>(o)->elem(index));
+			auto value = lisp.repl_apply(f, params);
+			if (value->type() == lisp_type_error)
+			{
+				auto e = error.load();
+				while (k < e && !error.compare_exchange_weak(e, k)) {}
+			}
+			if (local) results[k] = value;
+			else remote[k] = lisp.mail_pack(value);
+		}
+		lisp.env_pop();
+	};
+
+	//every element, the caller's share included, runs against a copy of the
+	//bindings the lambda can reach, its lambda and inputs, unpacked once per
+	//thread, so side effects never depend on which thread took an element,
+	//a sealed root goes across as a handle
+	auto msg = std::make_shared<Lisp_List>();
+	auto closure = env_closure(func);
+	msg->m_v.push_back(closure);
+	msg->m_v.push_back(func);
+	msg->m_v.push_back(seqs);
+	auto data = mail_pack(msg, closure);
+	//workers get what is left of an enclosing eval-budget
+	auto budget = m_budget;
+	budget.m_steps += std::max(m_tick, 0ll);
+	auto allocs = budget.m_alloc_limit && budget.m_allocs > lisp_obj_allocs ? budget.m_allocs - lisp_obj_allocs : 0;
+	std::atomic<bool> bad(false);
+	auto ship = [&] (Lisp &lisp, bool local)
+	{
+		auto obj = lisp.mail_unpack(data);
+		auto lst = std::static_pointer_cast<Lisp_List>(obj);
+		if (obj->type() != lisp_type_list || lst->m_v[0]->type() != lisp_type_env)
+		{
+			bad = true;
+			return;
+		}
+		auto env = std::static_pointer_cast<Lisp_Env>(lst->m_v[0]);
+		if (!env->m_parent) env->set_parent(lisp.env_root());
+		auto old_env = lisp.m_env;
+		lisp.m_env = lisp.env_overlay(env);
+		apply_loop(lisp, lst->m_v[1], std::static_pointer_cast<Lisp_List>(lst->m_v[2]), local);
+		lisp.m_env = old_env;
+	};
+
+	auto p = pool();
+	if (p && count > 1)
+	{
+		p->run([&] (Lisp &lisp)
+			{
+				lisp.m_budget = budget;
+				if (budget.m_alloc_limit) lisp.m_budget.m_allocs = lisp_obj_allocs + allocs;
+				lisp.m_tick = 0;
+				ship(lisp, false);
+			},
+			[&] { ship(*this, true); });
+	}
+	else ship(*this, true);
+	if (bad) return {repl_error(usage, error_msg_bad_message, func)};
+
+	auto len = std::min(count, error.load() + 1);
+	results.resize(len);
+	for (auto k = 0ll; k < len; ++k)
+	{
+		if (!results[k]) results[k] = mail_unpack(remote[k]);
+	}
+	return results;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::pmap(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() < 2)
+		return repl_error("(pmap lambda seq ...)", error_msg_wrong_num_of_args, args);
+	auto max_len = 1000000ll;
+	for (auto itr = begin(args->m_v) + 1; itr != end(args->m_v); ++itr)
+	{
+		if (!(*itr)->is_type(lisp_type_seq))
+			return repl_error("(pmap lambda seq ...)", error_msg_not_a_sequence, args);
+		max_len = std::min(max_len, std::static_pointer_cast<Lisp_Seq>(*itr)->length());
+	}
+	auto seqs = std::static_pointer_cast<Lisp_List>(args->slice(1, args->length()));
+	auto value = std::make_shared<Lisp_List>();
+	value->m_v = par_apply("(pmap lambda seq ...)", 0, max_len, args->m_v[0], seqs);
+	for (auto &&o : value->m_v) if (o->type() == lisp_type_error) return o;
+	return value;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::peach(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() != 4)
+		return repl_error("(peach! start end lambda (seq ...))", error_msg_wrong_num_of_args, args);
+	if (!args->m_v[3]->is_type(lisp_type_list))
+		return repl_error("(peach! start end lambda (seq ...))", error_msg_not_a_list, args);
+	if (args->m_v[0]->is_type(lisp_type_integer) && args->m_v[1]->is_type(lisp_type_integer))
+	{
+		auto seqs = std::static_pointer_cast<Lisp_List>(args->m_v[3]);
+		auto max_len = 1000000ll;
+		for (auto &&o : seqs->m_v)
+		{
+			if (!o->is_type(lisp_type_seq))
+				return repl_error("(peach! start end lambda (seq ...))", error_msg_not_a_sequence, args);
+			max_len = std::min(max_len, std::static_pointer_cast<Lisp_Seq>(o)->length());
+		}
+
+		auto value = std::static_pointer_cast<Lisp_Obj>(m_sym_nil);
+		if (max_len != 1000000)
+		{
+			auto start = std::static_pointer_cast<Lisp_Integer>(args->m_v[0])->m_value;
+			if (start < 0) start = max_len + start + 1;
+			auto end = std::static_pointer_cast<Lisp_Integer>(args->m_v[1])->m_value;
+			if (end < 0) end = max_len + end + 1;
+			if (start < 0 || start > max_len || end < 0 || end > max_len)
+				return repl_error("(peach! start end lambda (seq ...))", error_msg_not_valid_index, args);
+			auto results = par_apply("(peach! start end lambda (seq ...))", start, end, args->m_v[2], seqs);
+			if (!results.empty()) value = results.back();
+		}
+		return value;
+	}
+	return repl_error("(peach! start end lambda (seq ...))", error_msg_wrong_types, args);
+}
+
+//task threads, joined at exit before the statics they use are destroyed
+class Lisp_Tasks
+{
+public:
+	~Lisp_Tasks();
+	void spawn(std::function<void()> &&work);
+private:
+	typedef std::pair<std::thread, std::shared_ptr<std::atomic<bool>>> Task;
+	std::mutex m_mutex;
+	std::list<Task> m_tasks;
+};
+
+Lisp_Tasks::~Lisp_Tasks()
+{
+	//tasks may spawn more while we wait on them
+	for (;;)
+	{
+		std::list<Task> tasks;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			tasks.swap(m_tasks);
+		}
+		if (tasks.empty()) break;
+		for (auto &&t : tasks) t.first.join();
+	}
+}
+
+void Lisp_Tasks::spawn(std::function<void()> &&work)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_tasks.remove_if([] (auto &t)
+	{
+		if (!*t.second) return false;
+		t.first.join();
+		return true;
+	});
+	auto done = std::make_shared<std::atomic<bool>>(false);
+	m_tasks.emplace_back(std::thread([work = std::move(work), done] ()
+	{
+		work();
+		*done = true;
+	}), done);
+}
+
+Lisp_Tasks &tasks()
+{
+	static Lisp_Tasks tasks;
+	return tasks;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::taskspawn(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 2
+		&& args->m_v[1]->is_type(lisp_type_list))
+	{
+		//the task gets a deep copy of the env chain, lambda and args, and posts
+		//its result to the returned mailbox
+		auto result = std::make_shared<Lisp_Mailbox>(1);
+		auto msg = std::make_shared<Lisp_List>();
+		msg->m_v.push_back(m_env);
+		msg->m_v.push_back(args->m_v[0]);
+		msg->m_v.push_back(args->m_v[1]);
+		auto data = mail_pack(msg);
+		tasks().spawn([data = std::move(data), result] ()
+		{
+			Lisp lisp;
+			lisp.m_pool_size = 0;
+			auto obj = lisp.mail_unpack(data);
+			auto lst = std::static_pointer_cast<Lisp_List>(obj);
+			std::shared_ptr<Lisp_Obj> value;
+			if (obj->type() == lisp_type_list && lst->m_v[0]->type() == lisp_type_env)
+			{
+				lisp.m_env = lisp.env_overlay(std::static_pointer_cast<Lisp_Env>(lst->m_v[0]));
+				value = lisp.repl_apply(lst->m_v[1], std::static_pointer_cast<Lisp_List>(lst->m_v[2]));
+			}
+			else value = lisp.repl_error("(task-spawn lambda args)", error_msg_bad_message, lisp.m_sym_nil);
+			result->send(lisp.mail_pack(value));
+		});
+		return result;
+	}
+	return repl_error("(task-spawn lambda args)", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::mailbox(const std::shared_ptr<Lisp_List> &args)
+{
+	if (!args->length())
+	{
+		return std::make_shared<Lisp_Mailbox>(1024);
+	}
+	else if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_integer)
+		&& std::static_pointer_cast<Lisp_Integer>(args->m_v[0])->m_value > 0)
+	{
+		return std::make_shared<Lisp_Mailbox>(std::static_pointer_cast<Lisp_Integer>(args->m_v[0])->m_value);
+	}
+	return repl_error("(mail-box [capacity])", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::mailsend(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 2
+		&& args->m_v[0]->is_type(lisp_type_mailbox))
+	{
+		std::static_pointer_cast<Lisp_Mailbox>(args->m_v[0])->send(mail_pack(args->m_v[1]));
+		return args->m_v[1];
+	}
+	return repl_error("(mail-send mbox obj)", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::mailread(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_mailbox))
+	{
+		return mail_unpack(std::static_pointer_cast<Lisp_Mailbox>(args->m_v[0])->read());
+	}
+	return repl_error("(mail-read mbox)", error_msg_wrong_types, args);
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::mailpoll(const std::shared_ptr<Lisp_List> &args)
+{
+	if (args->length() == 1
+		&& args->m_v[0]->is_type(lisp_type_list))
+	{
+		auto lst = std::static_pointer_cast<Lisp_List>(args->m_v[0]);
+		if (std::all_of(begin(lst->m_v), end(lst->m_v), [] (auto &&o) { return o->is_type(lisp_type_mailbox); }))
+		{
+			for (auto itr = begin(lst->m_v); itr != end(lst->m_v); ++itr)
+			{
+				if (std::static_pointer_cast<Lisp_Mailbox>(*itr)->poll())
+					return std::make_shared<Lisp_Integer>(itr - begin(lst->m_v));
+			}
+			return m_sym_nil;
+		}
+	}
+	return repl_error("(mail-poll mboxes)", error_msg_wrong_types, args);
+}
+
+////////////////
+//build schedule
+////////////////
+
+struct Build_Node
+{
+	std::string m_path;
+	std::vector<size_t> m_deps;
+	std::vector<size_t> m_users;
+	size_t m_waiting = 0;
+	long long m_start = 0;
+	long long m_usecs = 0;
+	Lisp_Message m_job;
+	Lisp_Message m_result;
+};
+
+void build_scan(const std::shared_ptr<Lisp_Obj> &form, std::vector<std::string> &deps)
+{
+	//string paths of any (import path ...) or (include path) in the form
+	if (form->type() != lisp_type_list) return;
+	auto lst = std::static_pointer_cast<Lisp_List>(form);
+	if (lst->length() >= 2
+		&& lst->m_v[0]->type() == lisp_type_symbol
+		&& lst->m_v[1]->type() == lisp_type_string)
+	{
+		auto &name = std::static_pointer_cast<Lisp_Symbol>(lst->m_v[0])->m_string;
+		if (name == "import" || name == "include")
+		{
+			auto path = std::static_pointer_cast<Lisp_String>(lst->m_v[1])->m_string;
+			if (path.compare(0, 2, "./") == 0) path.erase(0, 2);
+			deps.push_back(path);
+		}
+	}
+	for (auto &&o : lst->m_v) build_scan(o, deps);
+}
+
+std::shared_ptr<Lisp_List> build_bindings(const std::shared_ptr<Lisp_Env> &env,
+	const std::vector<std::pair<Lisp_Symbol*, Lisp_Obj*>> &before)
+{
+	//flat sym/value list of bindings that are new or rebound since the snapshot
+	auto value = std::make_shared<Lisp_List>();
+	for (auto &&bucket : env->m_buckets)
+	{
+		for (auto &&pair : bucket)
+		{
+			auto itr = std::find_if(begin(before), end(before), [&] (auto &e) { return e.first == pair.first.get(); });
+			if (itr != end(before) && itr->second == pair.second.get()) continue;
+			value->m_v.push_back(pair.first);
+			value->m_v.push_back(pair.second);
+		}
+	}
+	return value;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::build_one(const std::shared_ptr<Lisp_Env> &target, const std::string &path)
+{
+	//evaluate one module in a fork of the target, then report what it defined
+	//as (error|nil bindings includes)
+	std::vector<std::pair<Lisp_Symbol*, Lisp_Obj*>> before;
+	for (auto &&bucket : target->m_buckets)
+		for (auto &&pair : bucket) before.emplace_back(pair.first.get(), pair.second.get());
+	auto old_env = m_env;
+	auto fork = env_overlay(target);
+	m_env = fork;
+	auto value = std::static_pointer_cast<Lisp_Obj>(m_sym_nil);
+	auto stream = std::make_shared<Lisp_File_IStream>(path);
+	auto args = std::make_shared<Lisp_List>();
+	args->m_v.push_back(stream);
+	args->m_v.push_back(std::make_shared<Lisp_String>(path));
+	if (!stream->is_open()) value = repl_error("(build-all files [env])", error_msg_open_error, args->m_v[1]);
+	else value = repl(args);
+	m_env = old_env;
+
+	auto bindings = build_bindings(target, before);
+	auto own = build_bindings(fork, {});
+	bindings->m_v.insert(end(bindings->m_v), begin(own->m_v), end(own->m_v));
+	auto includes = std::make_shared<Lisp_List>();
+	auto binds = std::make_shared<Lisp_List>();
+	for (auto itr = begin(bindings->m_v); itr != end(bindings->m_v); itr += 2)
+	{
+		auto sym = *itr;
+		if (sym == m_sym_stream_name || sym == m_sym_stream_line) continue;
+		if (sym == m_sym_file_includes)
+		{
+			if ((*(itr + 1))->type() == lisp_type_list)
+			{
+				auto &v = std::static_pointer_cast<Lisp_List>(*(itr + 1))->m_v;
+				includes->m_v.insert(end(includes->m_v), begin(v), end(v));
+			}
+			continue;
+		}
+		binds->m_v.push_back(sym);
+		binds->m_v.push_back(*(itr + 1));
+	}
+	auto result = std::make_shared<Lisp_List>();
+	result->m_v.push_back(value);
+	result->m_v.push_back(binds);
+	result->m_v.push_back(includes);
+	return result;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::buildall(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if ((len != 1 && len != 2)
+		|| !args->m_v[0]->is_type(lisp_type_list)
+		|| (len == 2 && !args->m_v[1]->is_type(lisp_type_env)))
+		return repl_error("(build-all files [env])", error_msg_wrong_types, args);
+	auto target = len == 2 ? std::static_pointer_cast<Lisp_Env>(args->m_v[1]) : m_env;
+	if (target->m_sealed) return repl_error("(build-all files [env])", error_msg_rebind_constant, args);
+	auto files = std::static_pointer_cast<Lisp_List>(args->m_v[0]);
+	if (!std::all_of(begin(files->m_v), end(files->m_v), [] (auto &&o) { return o->type() == lisp_type_string; }))
+		return repl_error("(build-all files [env])", error_msg_not_all_strings, args);
+
+	//scan the files, and any they import, into the dependency graph
+	std::vector<Build_Node> nodes;
+	std::map<std::string, size_t> index;
+	std::deque<size_t> scan;
+	auto add_node = [&] (std::string path)
+	{
+		if (path.compare(0, 2, "./") == 0) path.erase(0, 2);
+		auto itr = index.find(path);
+		if (itr != end(index)) return itr->second;
+		index[path] = nodes.size();
+		nodes.emplace_back();
+		nodes.back().m_path = path;
+		scan.push_back(nodes.size() - 1);
+		return nodes.size() - 1;
+	};
+	for (auto &&o : files->m_v) add_node(std::static_pointer_cast<Lisp_String>(o)->m_string);
+	env_push();
+	m_env->insert(m_sym_stream_line, std::make_shared<Lisp_Integer>(1));
+	while (!scan.empty())
+	{
+		auto n = scan.front();
+		scan.pop_front();
+		auto stream = std::make_shared<Lisp_File_IStream>(nodes[n].m_path);
+		if (!stream->is_open()) continue;
+		m_env->insert(m_sym_stream_name, std::make_shared<Lisp_String>(nodes[n].m_path));
+		std::vector<std::string> deps;
+		for (;;)
+		{
+			auto form = repl_read(*stream);
+			if (form == m_sym_nil || form->type() == lisp_type_error) break;
+			build_scan(form, deps);
+		}
+		for (auto &&dep : deps)
+		{
+			auto d = add_node(dep);
+			if (d == n || std::find(begin(nodes[n].m_deps), end(nodes[n].m_deps), d) != end(nodes[n].m_deps)) continue;
+			nodes[n].m_deps.push_back(d);
+			nodes[d].m_users.push_back(n);
+		}
+	}
+	env_pop();
+
+	//anything already imported into the target's env tree is not rebuilt
+	auto own_includes = [&] (const std::shared_ptr<Lisp_Env> &env)
+	{
+		auto bucket = env->get_bucket(m_sym_file_includes);
+		auto itr = std::find_if(begin(*bucket), end(*bucket), [&] (auto &e) { return e.first == m_sym_file_includes; });
+		if (itr == end(*bucket) || itr->second->type() != lisp_type_list) return std::shared_ptr<Lisp_List>();
+		return std::static_pointer_cast<Lisp_List>(itr->second);
+	};
+	auto built = std::set<std::string>();
+	for (auto env = target; env; env = env->get_parent())
+	{
+		auto lst = own_includes(env);
+		if (!lst) continue;
+		for (auto &&o : lst->m_v)
+			if (o->type() == lisp_type_string) built.insert(std::static_pointer_cast<Lisp_String>(o)->m_string);
+	}
+	auto include_list = own_includes(target);
+	if (!include_list)
+	{
+		include_list = std::make_shared<Lisp_List>();
+		target->insert(m_sym_file_includes, include_list);
+	}
+
+	auto merge = [&] (Build_Node &node, const std::shared_ptr<Lisp_Obj> &obj)
+	{
+		auto result = std::static_pointer_cast<Lisp_List>(obj);
+		auto binds = std::static_pointer_cast<Lisp_List>(result->m_v[1]);
+		for (auto itr = begin(binds->m_v); itr != end(binds->m_v); itr += 2)
+			target->insert(std::static_pointer_cast<Lisp_Symbol>(*itr), *(itr + 1));
+		auto paths = std::static_pointer_cast<Lisp_List>(result->m_v[2]);
+		paths->m_v.push_back(std::make_shared<Lisp_String>(node.m_path));
+		for (auto &&o : paths->m_v)
+		{
+			auto path = std::static_pointer_cast<Lisp_String>(o)->m_string;
+			if (built.insert(path).second) include_list->m_v.push_back(o);
+		}
+		return result->m_v[0];
+	};
+	auto job = [&] (Build_Node &node)
+	{
+		auto msg = std::make_shared<Lisp_List>();
+		msg->m_v.push_back(target);
+		msg->m_v.push_back(std::make_shared<Lisp_String>(node.m_path));
+		node.m_job = mail_pack(msg);
+	};
+
+	//order the graph, a cycle leaves nodes that never become ready
+	std::deque<size_t> ready;
+	for (auto n = 0u; n < nodes.size(); ++n)
+	{
+		nodes[n].m_waiting = std::count_if(begin(nodes[n].m_deps), end(nodes[n].m_deps),
+			[&] (auto d) { return !built.count(nodes[d].m_path); });
+		if (!nodes[n].m_waiting && !built.count(nodes[n].m_path)) ready.push_back(n);
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+	auto now = [&] ()
+	{
+		return (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::high_resolution_clock::now() - start).count();
+	};
+	auto value = std::static_pointer_cast<Lisp_Obj>(m_sym_nil);
+	std::vector<size_t> order;
+	auto p = pool();
+	auto workers = p ? p->size() : 0;
+	if (!p)
+	{
+		while (!ready.empty() && value == m_sym_nil)
+		{
+			auto n = ready.front();
+			ready.pop_front();
+			nodes[n].m_start = now();
+			auto result = build_one(target, nodes[n].m_path);
+			nodes[n].m_usecs = now() - nodes[n].m_start;
+			value = merge(nodes[n], result);
+			order.push_back(n);
+			for (auto u : nodes[n].m_users) if (!--nodes[u].m_waiting) ready.push_back(u);
+		}
+	}
+	else
+	{
+		//workers pull modules whose deps are merged, this thread merges
+		//results as they land and releases the modules waiting on them
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<size_t> done;
+		auto quit = false;
+		auto running = ready.size();
+		for (auto n : ready) job(nodes[n]);
+		p->run([&] (Lisp &lisp)
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				for (;;)
+				{
+					cv.wait(lock, [&] { return quit || !ready.empty(); });
+					if (quit) return;
+					auto n = ready.front();
+					ready.pop_front();
+					auto &node = nodes[n];
+					auto data = std::move(node.m_job);
+					lock.unlock();
+					node.m_start = now();
+					auto obj = lisp.mail_unpack(data);
+					auto lst = std::static_pointer_cast<Lisp_List>(obj);
+					std::shared_ptr<Lisp_Obj> result;
+					if (obj->type() == lisp_type_list && lst->m_v[0]->type() == lisp_type_env)
+						result = lisp.build_one(std::static_pointer_cast<Lisp_Env>(lst->m_v[0]), node.m_path);
+					else result = lisp.repl_error("(build-all files [env])", error_msg_bad_message,
+						std::make_shared<Lisp_String>(node.m_path));
+					node.m_result = lisp.mail_pack(result);
+					node.m_usecs = now() - node.m_start;
+					lock.lock();
+					done.push_back(n);
+					cv.notify_all();
+				}
+			},
+			[&] ()
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (running && value == m_sym_nil)
+				{
+					cv.wait(lock, [&] { return !done.empty(); });
+					auto n = done.front();
+					done.pop_front();
+					--running;
+					lock.unlock();
+					auto result = mail_unpack(nodes[n].m_result);
+					if (result->type() == lisp_type_list) value = merge(nodes[n], result);
+					else if (result->type() == lisp_type_error) value = result;
+					else value = repl_error("(build-all files [env])", error_msg_bad_message,
+						std::make_shared<Lisp_String>(nodes[n].m_path));
+					order.push_back(n);
+					std::vector<size_t> next;
+					if (value == m_sym_nil)
+					{
+						for (auto u : nodes[n].m_users)
+						{
+							if (--nodes[u].m_waiting || built.count(nodes[u].m_path)) continue;
+							job(nodes[u]);
+							next.push_back(u);
+						}
+					}
+					lock.lock();
+					ready.insert(end(ready), begin(next), end(next));
+					running += next.size();
+					cv.notify_all();
+				}
+				quit = true;
+				cv.notify_all();
+			});
+	}
+	auto wall = now();
+
+	//critical path, the longest chain of dependent module times
+	std::vector<long long> path_usecs(nodes.size(), 0);
+	std::vector<long long> path_prev(nodes.size(), -1);
+	auto busy = 0ll;
+	auto last = -1ll;
+	for (auto n : order)
+	{
+		for (auto d : nodes[n].m_deps)
+		{
+			if (path_usecs[d] <= path_usecs[n]) continue;
+			path_usecs[n] = path_usecs[d];
+			path_prev[n] = d;
+		}
+		path_usecs[n] += nodes[n].m_usecs;
+		busy += nodes[n].m_usecs;
+		if (last < 0 || path_usecs[n] > path_usecs[last]) last = n;
+	}
+	std::cout << "\n";
+	for (auto n : order)
+	{
+		std::cout << nodes[n].m_start / 1000.0 << "ms +" << nodes[n].m_usecs / 1000.0 << "ms " << nodes[n].m_path << "\n";
+	}
+	std::vector<std::string> chain;
+	for (auto n = last; n >= 0; n = path_prev[n]) chain.push_back(nodes[n].m_path);
+	std::cout << "critical path " << (last < 0 ? 0 : path_usecs[last]) / 1000.0 << "ms:";
+	for (auto itr = chain.rbegin(); itr != chain.rend(); ++itr) std::cout << (itr == chain.rbegin() ? " " : " -> ") << *itr;
+	std::cout << "\n" << order.size() << " modules, " << workers << " workers, "
+		<< wall / 1000.0 << "ms wall, " << busy / 1000.0 << "ms busy" << std::endl;
+
+	if (value->type() == lisp_type_error) return value;
+	//every module left waits on another left, so following them from any
+	//one of them comes round to a cycle
+	auto itr = std::find_if(begin(nodes), end(nodes), [&] (auto &node) { return !built.count(node.m_path); });
+	if (itr == end(nodes)) return target;
+	std::vector<size_t> trail;
+	std::map<size_t, size_t> seen;
+	for (auto n = (size_t)(itr - begin(nodes)); seen.emplace(n, trail.size()).second;)
+	{
+		trail.push_back(n);
+		auto dep = std::find_if(begin(nodes[n].m_deps), end(nodes[n].m_deps), [&] (auto d) { return !built.count(nodes[d].m_path); });
+		if (dep == end(nodes[n].m_deps)) break;
+		n = *dep;
+		if (seen.count(n)) trail.push_back(n);
+	}
+	auto cycle = std::make_shared<Lisp_List>();
+	for (auto i = seen[trail.back()]; i < trail.size(); ++i)
+		cycle->m_v.push_back(std::make_shared<Lisp_String>(nodes[trail[i]].m_path));
+	return repl_error("(build-all files [env])", error_msg_dependency_cycle, cycle);
+}
+
+////////////////
+//parallel reader
+////////////////
+
+//a slice of input already in memory, read in place
+class Read_Span : public Lisp_IStream
+{
+public:
+	Read_Span(const char *start, const char *end, long long line)
+		: Lisp_IStream()
+	{
+		m_pos = start;
+		m_end = end;
+		m_offset = end - start;
+		m_line = line;
+	}
+	const Lisp_Type type() const override { return lisp_type_istream; }
+	Lisp_Type is_type(Lisp_Type t) const override { return (Lisp_Type)(t & type_mask_istream); }
+	void print(std::ostream &out) const override { out << "<span istream>"; }
+	bool is_open() const override { return true; }
+	bool refill() override { return false; }
+};
+
+struct Read_Cut
+{
+	const char *m_pos;
+	long long m_line;
+};
+
+std::vector<Read_Cut> read_split(const char *start, const char *end, size_t chunks)
+{
+	//cuts go on whitespace at the top level, following the reader's own
+	//rules for where strings, comments and numbers start and end
+	std::vector<Read_Cut> cuts = {{start, 1}};
+	auto step = (end - start) / chunks;
+	auto next = start + step;
+	auto depth = 0ll;
+	auto line = 1ll;
+	auto token = true;
+	auto prefix = false;
+	for (auto p = start; p < end;)
+	{
+		auto c = (unsigned char)*p;
+		if (std::isspace(c))
+		{
+			if (!depth && !prefix && p >= next && cuts.size() < chunks)
+			{
+				cuts.push_back({p, line});
+				next = p + step;
+			}
+			if (c == '\n') ++line;
+			token = true;
+			++p;
+		}
+		else if (c == '(' || c == ')')
+		{
+			if (c == '(') ++depth;
+			else if (depth) --depth;
+			token = true;
+			prefix = false;
+			++p;
+		}
+		else if (!token) ++p;
+		else if (c == ';')
+		{
+			auto nl = (const char*)memchr(p, '\n', end - p);
+			p = nl ? nl : end;
+		}
+		else if (c == '"' || c == '{')
+		{
+			auto found = (const char*)memchr(p + 1, c == '"' ? '"' : '}', end - p - 1);
+			auto stop = found ? found + 1 : end;
+			line += std::count(p, stop, '\n');
+			p = stop;
+			prefix = false;
+		}
+		else if (c == 39 || c == '`' || c == ',' || c == '~')
+		{
+			prefix = true;
+			++p;
+		}
+		else if (c == '-' || std::isdigit(c))
+		{
+			//a '-' without a digit after it is a symbol on its own
+			++p;
+			if (c != '-' || (p < end && (unsigned char)*p >= '0'))
+			{
+				while (p < end && (*p == '.' || std::isalnum((unsigned char)*p))) ++p;
+			}
+			prefix = false;
+		}
+		else
+		{
+			token = false;
+			prefix = false;
+			++p;
+		}
+	}
+	return cuts;
+}
+
+std::shared_ptr<Lisp_Obj> Lisp::readall(const std::shared_ptr<Lisp_List> &args)
+{
+	auto len = args->length();
+	if ((len == 1 || len == 2)
+		&& args->m_v[0]->is_type(lisp_type_string)
+		&& (len == 1 || args->m_v[1]->is_type(lisp_type_integer)))
+	{
+		//regular files are parsed straight out of the mapping
+		auto name = std::static_pointer_cast<Lisp_String>(args->m_v[0]);
+		auto file = std::make_shared<Lisp_File_IStream>(name->m_string);
+		if (!file->is_open()) return m_sym_nil;
+		std::string data;
+		auto start = file->m_pos, end = file->m_end;
+		if (!file->m_map)
+		{
+			if (!file_load(name->m_string.c_str(), data)) return m_sym_nil;
+			start = data.data();
+			end = start + data.size();
+		}
+		auto threads = len == 2 ? std::static_pointer_cast<Lisp_Integer>(args->m_v[1])->m_value : (long long)m_pool_size;
+		threads = std::max(threads, 1ll);
+		const long long read_min_chunk = 64 * 1024;
+		auto chunks = std::min(threads * 4, (long long)(end - start) / read_min_chunk + 1);
+		auto cuts = read_split(start, end, chunks);
+
+		//each thread taking part pulls chunks in turn, the forms are plain
+		//data and only handed over once every thread is done with them
+		std::vector<std::vector<std::shared_ptr<Lisp_Obj>>> forms(cuts.size());
+		std::atomic<size_t> next(0);
+		std::atomic<long long> slots(0);
+		auto work = [&] (Lisp &lisp)
+		{
+			if (slots++ >= threads) return;
+			auto old_read_stream = lisp.m_read_stream;
+			lisp.env_push();
+			lisp.m_env->insert(lisp.m_sym_stream_name, name);
+			lisp.m_env->insert(lisp.m_sym_stream_line, std::make_shared<Lisp_Integer>(0));
+			for (;;)
+			{
+				auto k = next++;
+				if (k >= cuts.size()) break;
+				Read_Span in(cuts[k].m_pos, k + 1 < cuts.size() ? cuts[k + 1].m_pos : end, cuts[k].m_line);
+				lisp.m_read_stream = &in;
+				while (lisp.repl_read_whitespace(in) != -1)
+				{
+					auto form = lisp.repl_read(in);
+					forms[k].push_back(form);
+					if (form->type() == lisp_type_error) break;
+				}
+			}
+			lisp.m_read_stream = old_read_stream;
+			lisp.env_pop();
+		};
+		auto p = pool();
+		if (p && threads > 1 && cuts.size() > 1) p->run(work, [&] { work(*this); });
+		else work(*this);
+
+		auto value = std::make_shared<Lisp_List>();
+		auto total = 0ull;
+		for (auto &&f : forms) total += f.size();
+		value->m_v.reserve(total);
+		for (auto &&f : forms)
+		{
+			for (auto &&o : f)
+			{
+				if (o->type() == lisp_type_error) return o;
+				value->m_v.push_back(std::move(o));
+			}
+		}
+		return value;
+	}
+	return repl_error("(read-all path [threads])", error_msg_wrong_types, args);
+}
@@ -0,0 +1,21 @@
+;coroutines, run with ./chrysalisp test/coro.lisp </dev/null
+
+(defun check (name ok)
+	(print (if ok "ok   " "FAIL ") name))
+
+(defq log (list))
+(defq a (co-spawn (lambda (x) (push log :a) (co-yield) (push log :a) (* x 2)) '(21)))
+(defq b (co-spawn (lambda () (push log :b) (co-yield) (push log :b) :b)))
+(check "co-join returns the result" (eql (co-join a) 42))
+(check "co-join of a finished coroutine" (eql (co-join b) :b))
+(check "coroutines interleave at co-yield" (eql (str log) "(:a :b :a :b)"))
+
+(defq me nil)
+(setq me (co-spawn (lambda () (catch (co-join me) :deadlock))))
+(check "co-join on itself fails" (eql (co-join me) :deadlock))
+
+(defq r (mail-read (task-spawn (lambda ()
+	(co-spawn (lambda () (while t (co-yield))))
+	(co-yield)
+	:done) '())))
+(check "task exits with a coroutine suspended" (eql r :done))
@@ -0,0 +1,17 @@
+;serialize round trips, run with ./chrysalisp test/serial.lisp </dev/null
+
+(defun check (name ok)
+	(print (if ok "ok   " "FAIL ") name))
+
+(defq a (list 1 2) s (file-stream "test/serial.lisp"))
+
+(defq r (deserialize (serialize (list s a a))))
+(check "stream before shared list" (and (eql (elem 0 r) nil) (eql (elem 1 r) (elem 2 r))
+	(eql (length (elem 2 r)) 2)))
+
+(defq r (deserialize (serialize (list s s a (list s) a))))
+(check "streams between shared lists" (and (eql (elem 0 r) nil) (eql (elem 1 r) nil)
+	(eql (elem 2 r) (elem 4 r)) (eql (elem 0 (elem 3 r)) nil)))
+
+(defq r (mail-read (task-spawn (lambda (x y) (+ x y)) (list 2 3))))
+(check "task with a stream bound" (eql r 5))
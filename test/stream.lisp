@@ -0,0 +1,34 @@
+;stream reads, run with mkfifo /tmp/clp_test_fifo; ./chrysalisp test/stream.lisp </dev/null
+
+(defun check (name ok)
+	(print (if ok "ok   " "FAIL ") name))
+
+(defq s (string-stream ""))
+(check "empty string makes an input stream" (and (eql (read-line s) nil) (eql (read-char s) nil)
+	(eql (elem 0 (read s 32)) nil)))
+
+(defq s (string-stream))
+(write s "abc")
+(check "no string makes an output stream" (eql (str s) "abc"))
+
+(defq s (string-stream "ABCDE"))
+(check "read-packed stops before a short tail" (eql (str (read-packed s 2 10)) "(16961 17475)"))
+(check "short tail is left unread" (and (eql (read-char s) 69) (eql (read-char s) nil)))
+
+(defq i (io-stream "/tmp/clp_test_fifo"))
+(cond
+	(i
+		(defq o (file-stream "/tmp/clp_test_fifo" 2))
+		(write o "hel")
+		(flush o)
+		(check "read-line keeps a partial line" (eql (read-line i) nil))
+		(write o "lo")
+		(flush o)
+		(check "read-line waits on for its newline" (eql (read-line i) nil))
+		(write o (cat (char 10) "tail"))
+		(flush o)
+		(check "read-line gets the whole line" (eql (read-line i) "hello"))
+		(setq o nil)
+		(check "read-line gets a last line at the end" (eql (read-line i) "tail")))
+	(t
+		(check "read-line partial line, no /tmp/clp_test_fifo" nil)))
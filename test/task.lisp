@@ -0,0 +1,23 @@
+;parallel apply and build-all, run with ./chrysalisp -t 4 test/task.lisp </dev/null
+
+(defun check (name ok)
+	(print (if ok "ok   " "FAIL ") name))
+
+(defq c (list 0))
+(defq r (pmap (lambda (x) (elem-set 0 c (+ (elem 0 c) 1)) (* x 2)) (range 0 16)))
+(check "pmap results in order" (eql (str r) (str (map (lambda (x) (* x 2)) (range 0 16)))))
+(check "pmap side effects stay off the caller's objects" (eql (elem 0 c) 0))
+
+(defq r (catch (eval-budget '(pmap (lambda (x) (while t)) (range 0 4)) 10000) :budget))
+(check "pmap workers keep to an enclosing budget" (eql r :budget))
+
+(defun write-file (path text)
+	(defq s (file-stream path 1))
+	(write s text)
+	(flush s))
+(defun import-form (path)
+	(cat "(import " (char 34) path (char 34) ")"))
+(write-file "/tmp/clp_test_cycle_a.lisp" (import-form "/tmp/clp_test_cycle_b.lisp"))
+(write-file "/tmp/clp_test_cycle_b.lisp" (import-form "/tmp/clp_test_cycle_a.lisp"))
+(check "build-all fails on a dependency cycle"
+	(eql (catch (build-all (list "/tmp/clp_test_cycle_a.lisp")) :cycle) :cycle))